@@ -12,7 +12,7 @@ echo "deb-src http://files.freeswitch.org/repo/deb/freeswitch-1.8/ stretch main"
 exit 0
  )
 git clone https://freeswitch.org/stash/scm/fs/freeswitch.git /usr/local/src/freeswitch/ --branch v1.8.5
-git clone https://github.com/warmcat/libwebsockets.git /usr/local/src/freeswitch//libs/libwebsockets --branch v3.1.0
+git clone https://github.com/warmcat/libwebsockets.git /usr/local/src/freeswitch//libs/libwebsockets --branch v4.1.6
 git clone https://github.com/davehorton/drachtio-freeswitch-modules.git /usr/local/src/drachtio-freeswitch-modules
 patch /usr/local/src/freeswitch/configure.ac /files/configure.ac.patch
 cp -r /usr/local/src/drachtio-freeswitch-modules/modules/mod_audio_fork /usr/local/src/freeswitch//src/mod/applications/mod_audio_fork
@@ -21,7 +21,7 @@ patch /usr/local/src/freeswitch/build/modules.conf.in /files/modules.conf.in.pat
 cp /files/modules.conf.vanilla.xml.lws /usr/local/src/freeswitch//conf/vanilla/autoload_configs/modules.conf.xml
 test -f /usr/local/src/freeswitch//conf/vanilla/autoload_configs/modules.conf.xml || exit 1
 cd /usr/local/src/freeswitch//libs/libwebsockets
-mkdir -p build && cd build && cmake .. && make && make install
+mkdir -p build && cd build && cmake -DLWS_WITH_TLS_SESSIONS=ON .. && make && make install
 cp -r -n "/usr/local/src/drachtio-freeswitch-modules/modules/mod_google_tts/" "/usr/local/src/freeswitch//src/mod/applications/"
 cp -r -n "/usr/local/src/drachtio-freeswitch-modules/modules/mod_google_transcribe/" "/usr/local/src/freeswitch//src/mod/applications/"
 cp -r -n "/usr/local/src/drachtio-freeswitch-modules/modules/mod_dialogflow/" "/usr/local/src/freeswitch//src/mod/applications/"
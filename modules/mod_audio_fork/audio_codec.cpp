@@ -0,0 +1,232 @@
+#include "audio_codec.hpp"
+#include "mod_audio_fork.h"
+
+#include <algorithm>
+
+#include <opus/opus.h>
+#include <FLAC/stream_encoder.h>
+
+#define OPUS_FRAME_MS     20
+#define OPUS_MAX_PACKET   4000
+#define FLAC_BLOCK_MS     20
+
+namespace {
+
+  /* opus needs whole 20ms frames, so audio is accumulated until there is one to encode */
+  class OpusAudioEncoder : public drachtio::AudioEncoder {
+  public:
+    OpusAudioEncoder(OpusEncoder* encoder, uint32_t sampleRate, int channels) : 
+      m_encoder(encoder), m_channels(channels), m_frameSamples(sampleRate * OPUS_FRAME_MS / 1000) {
+      m_pending.reserve(m_frameSamples * channels);
+    }
+    virtual ~OpusAudioEncoder() {
+      opus_encoder_destroy(m_encoder);
+    }
+
+    virtual bool encode(const int16_t* pcm, uint32_t samples, const PacketWriter& writer) {
+      bool ok = true;
+      const int16_t* end = pcm + samples * m_channels;
+      while (pcm < end) {
+        size_t want = m_frameSamples * m_channels - m_pending.size();
+        size_t n = std::min(want, (size_t) (end - pcm));
+        m_pending.insert(m_pending.end(), pcm, pcm + n);
+        pcm += n;
+
+        if (m_pending.size() == m_frameSamples * m_channels) {
+          opus_int32 len = opus_encode(m_encoder, &m_pending[0], m_frameSamples, m_packet, OPUS_MAX_PACKET);
+          m_pending.clear();
+          if (len < 0) {
+            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "opus_encode failed: %s\n", opus_strerror(len));
+            ok = false;
+          }
+          else if (!writer(m_packet, len, m_frameSamples)) ok = false;
+        }
+      }
+      return ok;
+    }
+
+    virtual bool framed() const { return true; }
+
+  private:
+    OpusEncoder* m_encoder;
+    int m_channels;
+    uint32_t m_frameSamples;
+    std::vector<opus_int16> m_pending;
+    unsigned char m_packet[OPUS_MAX_PACKET];
+  };
+
+  /* FLAC is a self-delimiting stream, so its output can be split or joined across websocket messages freely */
+  class FlacAudioEncoder : public drachtio::AudioEncoder {
+  public:
+    FlacAudioEncoder(FLAC__StreamEncoder* encoder) : m_encoder(encoder), m_writer(nullptr), m_ok(true), m_channels(1) {}
+    virtual ~FlacAudioEncoder() {
+      FLAC__stream_encoder_delete(m_encoder);
+    }
+
+    bool init(uint32_t sampleRate, int channels) {
+      m_channels = channels;
+      FLAC__stream_encoder_set_channels(m_encoder, channels);
+      FLAC__stream_encoder_set_bits_per_sample(m_encoder, 16);
+      FLAC__stream_encoder_set_sample_rate(m_encoder, sampleRate);
+      FLAC__stream_encoder_set_compression_level(m_encoder, 5);
+      FLAC__stream_encoder_set_blocksize(m_encoder, sampleRate * FLAC_BLOCK_MS / 1000);
+
+      // the stream header is written during init, before there is anywhere to send it
+      if (FLAC__STREAM_ENCODER_INIT_STATUS_OK != 
+        FLAC__stream_encoder_init_stream(m_encoder, write_callback, NULL, NULL, NULL, this)) return false;
+      m_streamHeader = m_header;
+      return true;
+    }
+
+    virtual bool encode(const int16_t* pcm, uint32_t samples, const PacketWriter& writer) {
+      m_writer = &writer;
+      m_ok = true;
+      if (!m_header.empty()) {
+        if (writer(&m_header[0], m_header.size(), 0)) m_header.clear();
+        else m_ok = false;
+      }
+      m_scratch.assign(pcm, pcm + samples * m_channels);
+      if (!FLAC__stream_encoder_process_interleaved(m_encoder, &m_scratch[0], samples)) {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "FLAC__stream_encoder_process_interleaved failed\n");
+        m_ok = false;
+      }
+      m_writer = nullptr;
+      return m_ok;
+    }
+
+    virtual bool framed() const { return false; }
+
+    virtual std::vector<uint8_t> streamHeader() const { return m_streamHeader; }
+
+  private:
+    static FLAC__StreamEncoderWriteStatus write_callback(const FLAC__StreamEncoder *encoder, const FLAC__byte buffer[], 
+      size_t bytes, unsigned samples, unsigned current_frame, void *client_data) {
+      FlacAudioEncoder* self = static_cast<FlacAudioEncoder*>(client_data);
+      if (!self->m_writer) self->m_header.insert(self->m_header.end(), buffer, buffer + bytes);
+      else if (!(*self->m_writer)(buffer, bytes, samples)) self->m_ok = false;
+      return FLAC__STREAM_ENCODER_WRITE_STATUS_OK;
+    }
+
+    FLAC__StreamEncoder* m_encoder;
+    const PacketWriter* m_writer;
+    bool m_ok;
+    int m_channels;
+    std::vector<FLAC__int32> m_scratch;
+    std::vector<uint8_t> m_header;
+    std::vector<uint8_t> m_streamHeader;
+  };
+
+  /* G.711 is sample-by-sample, so every call produces exactly one packet and no audio is carried over */
+  class G711AudioEncoder : public drachtio::AudioEncoder {
+  public:
+    G711AudioEncoder(bool alaw, int channels) : m_alaw(alaw), m_channels(channels) {}
+
+    virtual bool encode(const int16_t* pcm, uint32_t samples, const PacketWriter& writer) {
+      size_t len = samples * m_channels;
+      m_packet.resize(len);
+      if (m_alaw) for (size_t i = 0; i < len; i++) m_packet[i] = linear_to_alaw(pcm[i]);
+      else for (size_t i = 0; i < len; i++) m_packet[i] = linear_to_ulaw(pcm[i]);
+      return writer(&m_packet[0], len, samples);
+    }
+
+    virtual bool framed() const { return false; }
+
+  private:
+    // segment (exponent) of a biased magnitude, i.e. the position of its highest set bit above bit 7
+    static int segment(int value) {
+      int seg = 0;
+      for (value >>= 8; value && seg < 7; value >>= 1) seg++;
+      return seg;
+    }
+
+    static uint8_t linear_to_ulaw(int16_t sample) {
+      int pcm = sample;
+      int mask = 0xff;
+      if (pcm < 0) {
+        pcm = -pcm - 1;
+        mask = 0x7f;
+      }
+      pcm = std::min(pcm, 32635) + 0x84;
+      int seg = segment(pcm);
+      return (uint8_t) (((seg << 4) | ((pcm >> (seg + 3)) & 0x0f)) ^ mask);
+    }
+
+    static uint8_t linear_to_alaw(int16_t sample) {
+      int pcm = sample;
+      int mask = 0xd5;
+      if (pcm < 0) {
+        pcm = -pcm - 1;
+        mask = 0x55;
+      }
+      int seg = segment(pcm);
+      int mantissa = seg ? (pcm >> (seg + 3)) & 0x0f : (pcm >> 4) & 0x0f;
+      return (uint8_t) (((seg << 4) | mantissa) ^ mask);
+    }
+
+    bool m_alaw;
+    int m_channels;
+    std::vector<uint8_t> m_packet;
+  };
+}
+
+namespace drachtio {
+
+  const char* audio_codec_name(int codec) {
+    switch (codec) {
+      case AUDIO_FORK_CODEC_OPUS: return "opus";
+      case AUDIO_FORK_CODEC_FLAC: return "flac";
+      case AUDIO_FORK_CODEC_PCMU: return "ulaw";
+      case AUDIO_FORK_CODEC_PCMA: return "alaw";
+      default: return "L16";
+    }
+  }
+
+  AudioEncoder* AudioEncoder::create(int codec, uint32_t sampleRate, int channels, std::string& error) {
+    switch (codec) {
+      case AUDIO_FORK_CODEC_OPUS:
+        {
+          int err;
+          if (sampleRate != 8000 && sampleRate != 12000 && sampleRate != 16000 && sampleRate != 24000 && sampleRate != 48000) {
+            error = "opus requires a sample rate of 8k, 12k, 16k, 24k or 48k";
+            return nullptr;
+          }
+          OpusEncoder* encoder = opus_encoder_create(sampleRate, channels, OPUS_APPLICATION_VOIP, &err);
+          if (OPUS_OK != err) {
+            error = opus_strerror(err);
+            return nullptr;
+          }
+          opus_encoder_ctl(encoder, OPUS_SET_SIGNAL(OPUS_SIGNAL_VOICE));
+          return new OpusAudioEncoder(encoder, sampleRate, channels);
+        }
+
+      case AUDIO_FORK_CODEC_FLAC:
+        {
+          FLAC__StreamEncoder* encoder = FLAC__stream_encoder_new();
+          if (!encoder) {
+            error = "FLAC__stream_encoder_new failed";
+            return nullptr;
+          }
+          FlacAudioEncoder* flac = new FlacAudioEncoder(encoder);
+          if (!flac->init(sampleRate, channels)) {
+            delete flac;
+            error = "FLAC__stream_encoder_init_stream failed";
+            return nullptr;
+          }
+          return flac;
+        }
+
+      case AUDIO_FORK_CODEC_PCMU:
+      case AUDIO_FORK_CODEC_PCMA:
+        if (sampleRate != 8000) {
+          error = "G.711 requires a sample rate of 8k";
+          return nullptr;
+        }
+        return new G711AudioEncoder(AUDIO_FORK_CODEC_PCMA == codec, channels);
+
+      default:
+        error = "unsupported codec";
+        return nullptr;
+    }
+  }
+
+}
@@ -0,0 +1,49 @@
+#ifndef __AUDIO_CODEC_HPP__
+#define __AUDIO_CODEC_HPP__
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace drachtio {
+
+/// Header written in front of every packet of audio in a session's ring
+struct audio_packet_header {
+  uint32_t len;       // payload bytes following the header
+  uint32_t samples;   // samples per channel represented by the payload
+  uint32_t seq;       // numbers the capture's packets consecutively, so gaps show where audio was dropped
+  int64_t captured;   // wall clock time (microseconds) the packet was written by the media thread
+};
+
+const char* audio_codec_name(int codec);
+
+/// Encodes the forked L16 audio into the wire format requested on uuid_audio_fork start
+/**
+ * Encoders run on the media thread and hand each finished packet to a PacketWriter, which
+ * normally stores it in the session's ring.  They keep whatever partial frame is left over
+ * between calls, so callers can pass in media bug frames of any size.
+ */
+class AudioEncoder {
+public:
+  /// receives an encoded packet and the samples per channel it holds; returns false if it was dropped
+  typedef std::function<bool (const uint8_t* data, size_t len, uint32_t samples)> PacketWriter;
+
+  /// returns NULL and sets error if the codec can not be used with this sample rate and channel count
+  static AudioEncoder* create(int codec, uint32_t sampleRate, int channels, std::string& error);
+
+  virtual ~AudioEncoder() {}
+
+  /// encode interleaved L16 audio (samples is per channel); returns false if any packet was dropped
+  virtual bool encode(const int16_t* pcm, uint32_t samples, const PacketWriter& writer) = 0;
+
+  /// true if each packet has to go in a websocket message of its own for the far end to decode it
+  virtual bool framed() const = 0;
+
+  /// what a far end picking the stream up part way through needs first, e.g. the FLAC stream header
+  virtual std::vector<uint8_t> streamHeader() const { return std::vector<uint8_t>(); }
+};
+
+} // namespace drachtio
+
+#endif // __AUDIO_CODEC_HPP__
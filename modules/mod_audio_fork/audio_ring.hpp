@@ -0,0 +1,113 @@
+#ifndef __AUDIO_RING_HPP__
+#define __AUDIO_RING_HPP__
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+namespace drachtio {
+
+/// Lock-free single producer / single consumer byte ring buffer
+/**
+ * The media thread is the only producer and the lws service thread is the only consumer;
+ * neither side ever blocks or takes a lock.  Read and write positions are free running
+ * counters, so the number of bytes buffered is always head - tail and the capacity does
+ * not need to be a power of two.
+ *
+ * Storage is supplied by the caller (normally the session memory pool) so that it remains
+ * valid for as long as either thread could still touch it.
+ */
+class AudioRing {
+public:
+  AudioRing(uint8_t* storage, size_t capacity) : m_buf(storage), m_capacity(capacity), m_head(0), m_tail(0) {}
+
+  size_t capacity() const { return m_capacity; }
+
+  /// number of bytes available to the consumer
+  size_t size() const {
+    return m_head.load(std::memory_order_acquire) - m_tail.load(std::memory_order_acquire);
+  }
+
+  /// number of bytes the producer can write without overrunning the consumer
+  size_t freeSpace() const { return m_capacity - size(); }
+
+  /// producer: write len bytes; either all of it fits or nothing is written
+  bool write(const void* data, size_t len) {
+    const size_t head = m_head.load(std::memory_order_relaxed);
+    const size_t tail = m_tail.load(std::memory_order_acquire);
+    if (m_capacity - (head - tail) < len) return false;
+    copyIn(head, static_cast<const uint8_t*>(data), len);
+    m_head.store(head + len, std::memory_order_release);
+    return true;
+  }
+
+  /// producer: write a header and its payload as a single unit; either both fit or nothing is written
+  bool write(const void* hdr, size_t hdrLen, const void* data, size_t len) {
+    const size_t head = m_head.load(std::memory_order_relaxed);
+    const size_t tail = m_tail.load(std::memory_order_acquire);
+    if (m_capacity - (head - tail) < hdrLen + len) return false;
+    copyIn(head, static_cast<const uint8_t*>(hdr), hdrLen);
+    copyIn(head + hdrLen, static_cast<const uint8_t*>(data), len);
+    m_head.store(head + hdrLen + len, std::memory_order_release);
+    return true;
+  }
+
+  /// consumer: copy up to len bytes without consuming them, returns the number of bytes copied
+  size_t peek(void* out, size_t len) const {
+    const size_t tail = m_tail.load(std::memory_order_relaxed);
+    const size_t head = m_head.load(std::memory_order_acquire);
+    size_t n = std::min(len, head - tail);
+    copyOut(tail, static_cast<uint8_t*>(out), n);
+    return n;
+  }
+
+  /// consumer: read up to len bytes, returns the number of bytes read
+  size_t read(void* out, size_t len) {
+    const size_t tail = m_tail.load(std::memory_order_relaxed);
+    const size_t head = m_head.load(std::memory_order_acquire);
+    size_t n = std::min(len, head - tail);
+    copyOut(tail, static_cast<uint8_t*>(out), n);
+    m_tail.store(tail + n, std::memory_order_release);
+    return n;
+  }
+
+  /// consumer: throw away up to len bytes, returns the number of bytes discarded
+  size_t discard(size_t len) {
+    const size_t tail = m_tail.load(std::memory_order_relaxed);
+    const size_t head = m_head.load(std::memory_order_acquire);
+    size_t n = std::min(len, head - tail);
+    m_tail.store(tail + n, std::memory_order_release);
+    return n;
+  }
+
+private:
+  void copyIn(size_t pos, const uint8_t* data, size_t len) {
+    size_t offset = pos % m_capacity;
+    size_t first = std::min(len, m_capacity - offset);
+    memcpy(m_buf + offset, data, first);
+    if (len > first) memcpy(m_buf, data + first, len - first);
+  }
+
+  void copyOut(size_t pos, uint8_t* out, size_t len) const {
+    size_t offset = pos % m_capacity;
+    size_t first = std::min(len, m_capacity - offset);
+    memcpy(out, m_buf + offset, first);
+    if (len > first) memcpy(out + first, m_buf, len - first);
+  }
+
+  uint8_t* m_buf;
+  const size_t m_capacity;
+
+  // keep the producer and consumer positions on separate cache lines
+  char m_pad0[64];
+  std::atomic<size_t> m_head;
+  char m_pad1[64 - sizeof(std::atomic<size_t>)];
+  std::atomic<size_t> m_tail;
+  char m_pad2[64 - sizeof(std::atomic<size_t>)];
+};
+
+} // namespace drachtio
+
+#endif // __AUDIO_RING_HPP__
@@ -5,6 +5,9 @@
     done by Peter Thorson (webmaster@zaphoyd.com) in 2012. All modifications to
     the code are redistributed under the same license as the original, which is
     listed below.
+
+    Altered for mod_audio_fork: base64_decode() is now table driven, decodes into
+    a caller supplied buffer, and uses SSE4.1 or AVX2 when the CPU supports them.
     ******
 
    base64.cpp and base64.h
@@ -37,6 +40,13 @@
 #define _BASE64_HPP_
 
 #include <string>
+#include <cstddef>
+#include <cstdint>
+
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define BASE64_X86_SIMD 1
+#include <immintrin.h>
+#endif
 
 namespace drachtio {
 
@@ -123,53 +133,183 @@ inline std::string base64_encode(std::string const & input) {
     );
 }
 
-/// Decode a base64 encoded string into a string of raw bytes
-/**
- * @param input The base64 encoded input data
- * @return A string representing the decoded raw bytes
- */
-inline std::string base64_decode(std::string const & input) {
-    size_t in_len = input.size();
-    int i = 0;
-    int j = 0;
-    int in_ = 0;
-    unsigned char char_array_4[4], char_array_3[3];
-    std::string ret;
+namespace detail {
 
-    while (in_len-- && ( input[in_] != '=') && is_base64(input[in_])) {
-        char_array_4[i++] = input[in_]; in_++;
-        if (i ==4) {
-            for (i = 0; i <4; i++) {
-                char_array_4[i] = static_cast<unsigned char>(base64_chars.find(char_array_4[i]));
-            }
+/// Maps each character to its 6 bit value, or 0xff if it is not part of the base64 alphabet
+struct base64_decode_table {
+    unsigned char values[256];
+    base64_decode_table() {
+        for (int i = 0; i < 256; i++) values[i] = 0xff;
+        for (int i = 0; i < 64; i++) values[static_cast<unsigned char>(base64_chars[i])] = static_cast<unsigned char>(i);
+    }
+};
 
-            char_array_3[0] = (char_array_4[0] << 2) + ((char_array_4[1] & 0x30) >> 4);
-            char_array_3[1] = ((char_array_4[1] & 0xf) << 4) + ((char_array_4[2] & 0x3c) >> 2);
-            char_array_3[2] = ((char_array_4[2] & 0x3) << 6) + char_array_4[3];
+static inline const unsigned char* base64_values() {
+    static const base64_decode_table table;
+    return table.values;
+}
 
-            for (i = 0; (i < 3); i++) {
-                ret += char_array_3[i];
-            }
-            i = 0;
-        }
+/// Decode until the first '=' or character outside the alphabet, as the original implementation did
+inline size_t base64_decode_scalar(const char* input, size_t len, unsigned char* out) {
+    const unsigned char* values = base64_values();
+    const unsigned char* in = reinterpret_cast<const unsigned char*>(input);
+    unsigned char* start = out;
+    size_t i = 0;
+
+    for (; i + 4 <= len; i += 4) {
+        unsigned char a = values[in[i]], b = values[in[i + 1]], c = values[in[i + 2]], d = values[in[i + 3]];
+        if ((a | b | c | d) & 0x80) break;
+        uint32_t triple = (a << 18) | (b << 12) | (c << 6) | d;
+        *out++ = static_cast<unsigned char>(triple >> 16);
+        *out++ = static_cast<unsigned char>(triple >> 8);
+        *out++ = static_cast<unsigned char>(triple);
     }
 
-    if (i) {
-        for (j = i; j <4; j++)
-            char_array_4[j] = 0;
+    // trailing partial quantum, padding, or an invalid character
+    uint32_t triple = 0;
+    int n = 0;
+    for (; i < len && n < 4; i++, n++) {
+        unsigned char v = values[in[i]];
+        if (v & 0x80) break;
+        triple |= v << (18 - 6 * n);
+    }
+    if (n > 1) *out++ = static_cast<unsigned char>(triple >> 16);
+    if (n > 2) *out++ = static_cast<unsigned char>(triple >> 8);
+    if (n > 3) *out++ = static_cast<unsigned char>(triple);
 
-        for (j = 0; j <4; j++)
-            char_array_4[j] = static_cast<unsigned char>(base64_chars.find(char_array_4[j]));
+    return out - start;
+}
 
-        char_array_3[0] = (char_array_4[0] << 2) + ((char_array_4[1] & 0x30) >> 4);
-        char_array_3[1] = ((char_array_4[1] & 0xf) << 4) + ((char_array_4[2] & 0x3c) >> 2);
-        char_array_3[2] = ((char_array_4[2] & 0x3) << 6) + char_array_4[3];
+#ifdef BASE64_X86_SIMD
 
-        for (j = 0; (j < i - 1); j++) {
-            ret += static_cast<std::string::value_type>(char_array_3[j]);
-        }
+/*
+ * Vector decoding follows Wojciech Mula's pshufb lookup: the high nibble of each character
+ * selects the offset that maps it to its 6 bit value, and a bitmask lookup on both nibbles
+ * flags anything outside the alphabet.  Blocks containing '=' or an invalid character are
+ * left for the scalar decoder.  Each store writes a full vector of which only 3/4 is output,
+ * so the loops stop while there is still enough input left to guarantee room for the overrun.
+ */
+
+__attribute__((target("sse4.1")))
+inline size_t base64_decode_sse41(const char* input, size_t len, unsigned char* out, size_t* consumed) {
+    const __m128i shiftLUT = _mm_setr_epi8(0, 0, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m128i maskLUT = _mm_setr_epi8(
+        (char) 0xa8, (char) 0xf8, (char) 0xf8, (char) 0xf8, (char) 0xf8, (char) 0xf8, (char) 0xf8, (char) 0xf8,
+        (char) 0xf8, (char) 0xf8, (char) 0xf0, 0x54, 0x50, 0x50, 0x50, 0x54);
+    const __m128i bitposLUT = _mm_setr_epi8(0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, (char) 0x80, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m128i pack = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+    unsigned char* start = out;
+    size_t i = 0;
+
+    for (; i + 24 <= len; i += 16) {
+        const __m128i chars = _mm_loadu_si128(reinterpret_cast<const __m128i*>(input + i));
+        const __m128i hi = _mm_and_si128(_mm_srli_epi32(chars, 4), _mm_set1_epi8(0x0f));
+        const __m128i lo = _mm_and_si128(chars, _mm_set1_epi8(0x0f));
+        const __m128i invalid = _mm_cmpeq_epi8(
+            _mm_and_si128(_mm_shuffle_epi8(maskLUT, lo), _mm_shuffle_epi8(bitposLUT, hi)), _mm_setzero_si128());
+        if (_mm_movemask_epi8(invalid)) break;
+
+        const __m128i shift = _mm_blendv_epi8(_mm_shuffle_epi8(shiftLUT, hi), _mm_set1_epi8(16), 
+            _mm_cmpeq_epi8(chars, _mm_set1_epi8('/')));
+        const __m128i values = _mm_add_epi8(chars, shift);
+        const __m128i merged = _mm_madd_epi16(_mm_maddubs_epi16(values, _mm_set1_epi32(0x01400140)), _mm_set1_epi32(0x00011000));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out), _mm_shuffle_epi8(merged, pack));
+        out += 12;
     }
+    *consumed = i;
+    return out - start;
+}
 
+__attribute__((target("avx2")))
+inline size_t base64_decode_avx2(const char* input, size_t len, unsigned char* out, size_t* consumed) {
+    const __m256i shiftLUT = _mm256_setr_epi8(
+        0, 0, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0,
+        0, 0, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m256i maskLUT = _mm256_setr_epi8(
+        (char) 0xa8, (char) 0xf8, (char) 0xf8, (char) 0xf8, (char) 0xf8, (char) 0xf8, (char) 0xf8, (char) 0xf8,
+        (char) 0xf8, (char) 0xf8, (char) 0xf0, 0x54, 0x50, 0x50, 0x50, 0x54,
+        (char) 0xa8, (char) 0xf8, (char) 0xf8, (char) 0xf8, (char) 0xf8, (char) 0xf8, (char) 0xf8, (char) 0xf8,
+        (char) 0xf8, (char) 0xf8, (char) 0xf0, 0x54, 0x50, 0x50, 0x50, 0x54);
+    const __m256i bitposLUT = _mm256_setr_epi8(
+        0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, (char) 0x80, 0, 0, 0, 0, 0, 0, 0, 0,
+        0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, (char) 0x80, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m256i pack = _mm256_setr_epi8(
+        2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+        2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+    const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 7, 7);
+    unsigned char* start = out;
+    size_t i = 0;
+
+    for (; i + 48 <= len; i += 32) {
+        const __m256i chars = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(input + i));
+        const __m256i hi = _mm256_and_si256(_mm256_srli_epi32(chars, 4), _mm256_set1_epi8(0x0f));
+        const __m256i lo = _mm256_and_si256(chars, _mm256_set1_epi8(0x0f));
+        const __m256i invalid = _mm256_cmpeq_epi8(
+            _mm256_and_si256(_mm256_shuffle_epi8(maskLUT, lo), _mm256_shuffle_epi8(bitposLUT, hi)), _mm256_setzero_si256());
+        if (_mm256_movemask_epi8(invalid)) break;
+
+        const __m256i shift = _mm256_blendv_epi8(_mm256_shuffle_epi8(shiftLUT, hi), _mm256_set1_epi8(16), 
+            _mm256_cmpeq_epi8(chars, _mm256_set1_epi8('/')));
+        const __m256i values = _mm256_add_epi8(chars, shift);
+        const __m256i merged = _mm256_madd_epi16(_mm256_maddubs_epi16(values, _mm256_set1_epi32(0x01400140)), _mm256_set1_epi32(0x00011000));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out), _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(merged, pack), lanes));
+        out += 24;
+    }
+    *consumed = i;
+    return out - start;
+}
+
+typedef size_t (*base64_simd_decoder)(const char*, size_t, unsigned char*, size_t*);
+
+static inline base64_simd_decoder base64_select_decoder() {
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return base64_decode_avx2;
+    if (__builtin_cpu_supports("sse4.1")) return base64_decode_sse41;
+    return nullptr;
+}
+
+#endif // BASE64_X86_SIMD
+
+} // namespace detail
+
+/// Upper bound on the number of bytes base64_decode() will write for len characters of input
+inline size_t base64_decoded_size(size_t len) {
+    return (len + 3) / 4 * 3;
+}
+
+/// Decode base64 encoded data into a caller supplied buffer in a single pass
+/**
+ * Decoding stops at the first '=' or character outside the base64 alphabet.
+ *
+ * @param input The base64 encoded input data
+ * @param len The length of input in bytes
+ * @param out Buffer of at least base64_decoded_size(len) bytes
+ * @return The number of bytes written to out
+ */
+inline size_t base64_decode(const char* input, size_t len, unsigned char* out) {
+    size_t written = 0;
+#ifdef BASE64_X86_SIMD
+    static const detail::base64_simd_decoder simd = detail::base64_select_decoder();
+    if (simd) {
+        size_t consumed = 0;
+        written = simd(input, len, out, &consumed);
+        input += consumed;
+        len -= consumed;
+    }
+#endif
+    return written + detail::base64_decode_scalar(input, len, out + written);
+}
+
+/// Decode a base64 encoded string into a string of raw bytes
+/**
+ * @param input The base64 encoded input data
+ * @return A string representing the decoded raw bytes
+ */
+inline std::string base64_decode(std::string const & input) {
+    std::string ret(base64_decoded_size(input.size()), '\0');
+    if (!input.empty()) {
+        ret.resize(base64_decode(input.data(), input.size(), reinterpret_cast<unsigned char*>(&ret[0])));
+    }
     return ret;
 }
 
@@ -0,0 +1,190 @@
+/*
+ * base64_bench.cpp -- compares base64_decode() in base64.hpp with the decoder it replaced
+ *
+ * Every kernel (scalar, SSE4.1 and AVX2, as far as this cpu supports them) is first checked against
+ * the original implementation on randomized input, including padding, invalid characters and
+ * truncated blocks; then each is timed decoding a playAudio sized payload.  Exits non-zero if any
+ * kernel decodes anything differently.
+ *
+ *   make -C bench && ./bench/base64_bench [payload bytes] [iterations]
+ */
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "../base64.hpp"
+
+namespace reference {
+
+/* base64_decode() as it was before it was vectorized, kept verbatim as the reference */
+inline std::string base64_decode(std::string const & input) {
+    size_t in_len = input.size();
+    int i = 0;
+    int j = 0;
+    int in_ = 0;
+    unsigned char char_array_4[4], char_array_3[3];
+    std::string ret;
+
+    while (in_len-- && ( input[in_] != '=') && drachtio::is_base64(input[in_])) {
+        char_array_4[i++] = input[in_]; in_++;
+        if (i ==4) {
+            for (i = 0; i <4; i++) {
+                char_array_4[i] = static_cast<unsigned char>(drachtio::base64_chars.find(char_array_4[i]));
+            }
+
+            char_array_3[0] = (char_array_4[0] << 2) + ((char_array_4[1] & 0x30) >> 4);
+            char_array_3[1] = ((char_array_4[1] & 0xf) << 4) + ((char_array_4[2] & 0x3c) >> 2);
+            char_array_3[2] = ((char_array_4[2] & 0x3) << 6) + char_array_4[3];
+
+            for (i = 0; (i < 3); i++) {
+                ret += char_array_3[i];
+            }
+            i = 0;
+        }
+    }
+
+    if (i) {
+        for (j = i; j <4; j++)
+            char_array_4[j] = 0;
+
+        for (j = 0; j <4; j++)
+            char_array_4[j] = static_cast<unsigned char>(drachtio::base64_chars.find(char_array_4[j]));
+
+        char_array_3[0] = (char_array_4[0] << 2) + ((char_array_4[1] & 0x30) >> 4);
+        char_array_3[1] = ((char_array_4[1] & 0xf) << 4) + ((char_array_4[2] & 0x3c) >> 2);
+        char_array_3[2] = ((char_array_4[2] & 0x3) << 6) + char_array_4[3];
+
+        for (j = 0; (j < i - 1); j++) {
+            ret += static_cast<std::string::value_type>(char_array_3[j]);
+        }
+    }
+
+    return ret;
+}
+
+} // namespace reference
+
+namespace {
+
+typedef size_t (*simd_kernel)(const char*, size_t, unsigned char*, size_t*);
+
+struct kernel {
+  const char* name;
+  simd_kernel simd;   // nullptr for the scalar decoder alone
+};
+
+std::string decodeWith(const kernel& k, const std::string& input) {
+  std::string out(drachtio::base64_decoded_size(input.size()), '\0');
+  if (input.empty()) return std::string();
+  const char* in = input.data();
+  size_t len = input.size();
+  unsigned char* dst = reinterpret_cast<unsigned char*>(&out[0]);
+  size_t written = 0;
+  if (k.simd) {
+    size_t consumed = 0;
+    written = k.simd(in, len, dst, &consumed);
+    in += consumed;
+    len -= consumed;
+  }
+  written += drachtio::detail::base64_decode_scalar(in, len, dst + written);
+  out.resize(written);
+  return out;
+}
+
+std::vector<kernel> availableKernels() {
+  std::vector<kernel> kernels;
+  kernel scalar = { "scalar", nullptr };
+  kernels.push_back(scalar);
+#ifdef BASE64_X86_SIMD
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse4.1")) {
+    kernel k = { "sse4.1", drachtio::detail::base64_decode_sse41 };
+    kernels.push_back(k);
+  }
+  if (__builtin_cpu_supports("avx2")) {
+    kernel k = { "avx2", drachtio::detail::base64_decode_avx2 };
+    kernels.push_back(k);
+  }
+#endif
+  return kernels;
+}
+
+std::string randomBytes(std::mt19937& rng, size_t len) {
+  std::string s(len, '\0');
+  for (size_t i = 0; i < len; i++) s[i] = static_cast<char>(rng() & 0xff);
+  return s;
+}
+
+/* valid base64 of random data, then (sometimes) damaged: a stray character, a cut, or noise appended */
+std::string randomInput(std::mt19937& rng) {
+  std::string encoded = drachtio::base64_encode(randomBytes(rng, rng() % 400));
+  switch (rng() % 5) {
+    case 0:
+      if (!encoded.empty()) encoded[rng() % encoded.size()] = static_cast<char>(rng() & 0xff);
+      break;
+    case 1:
+      encoded.resize(rng() % (encoded.size() + 1));
+      break;
+    case 2:
+      encoded += randomBytes(rng, rng() % 8);
+      break;
+    default:
+      break;
+  }
+  return encoded;
+}
+
+bool crossCheck(const std::vector<kernel>& kernels, size_t cases) {
+  std::mt19937 rng(20240601);
+  size_t failures = 0;
+  for (size_t n = 0; n < cases; n++) {
+    std::string input = randomInput(rng);
+    std::string expected = reference::base64_decode(input);
+    for (auto it = kernels.begin(); it != kernels.end(); ++it) {
+      if (decodeWith(*it, input) != expected) {
+        if (failures++ < 10) fprintf(stderr, "MISMATCH %s on %lu chars: \"%s\"\n", it->name, input.size(), input.c_str());
+      }
+    }
+    if (drachtio::base64_decode(input) != expected) {
+      if (failures++ < 10) fprintf(stderr, "MISMATCH base64_decode on %lu chars: \"%s\"\n", input.size(), input.c_str());
+    }
+  }
+  printf("cross-check: %lu inputs, %lu kernels, %lu mismatches\n", cases, kernels.size(), failures);
+  return 0 == failures;
+}
+
+template <typename F>
+double millisPerDecode(F decode, int iterations) {
+  decode();
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < iterations; i++) decode();
+  std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+  return elapsed.count() / iterations;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+  size_t payload = argc > 1 ? strtoul(argv[1], nullptr, 10) : 512 * 1024;
+  int iterations = argc > 2 ? atoi(argv[2]) : 50;
+  std::vector<kernel> kernels = availableKernels();
+
+  if (!crossCheck(kernels, 20000)) return 1;
+
+  std::mt19937 rng(1);
+  std::string input = drachtio::base64_encode(randomBytes(rng, payload));
+  printf("decoding %lu bytes of base64 (%lu bytes of audio), %d iterations\n", input.size(), payload, iterations);
+
+  volatile size_t sink = 0;
+  double baseline = millisPerDecode([&] { sink += reference::base64_decode(input).size(); }, iterations);
+  printf("  %-10s %9.3f ms\n", "original", baseline);
+  for (auto it = kernels.begin(); it != kernels.end(); ++it) {
+    const kernel& k = *it;
+    double ms = millisPerDecode([&] { sink += decodeWith(k, input).size(); }, iterations);
+    printf("  %-10s %9.3f ms  %6.1fx\n", k.name, ms, baseline / ms);
+  }
+  return 0;
+}
@@ -0,0 +1,95 @@
+#ifndef __BROADCAST_RING_HPP__
+#define __BROADCAST_RING_HPP__
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+namespace drachtio {
+
+/// Lock-free single producer / multiple consumer packet ring buffer
+/**
+ * The media thread writes each captured (and possibly encoded) packet once, and every websocket
+ * destination forked from that capture reads it through a cursor of its own, on whichever lws
+ * service thread owns that connection.  The producer never waits for, or even looks at, the
+ * consumers: when the ring is full the oldest audio is overwritten.  A consumer that falls that
+ * far behind finds out when it validates what it copied, and skips ahead to the newest packet,
+ * so one stalled destination never costs the others any audio.
+ *
+ * Positions are free running byte counters, as in AudioRing.  Storage is supplied by the caller.
+ */
+class BroadcastRing {
+public:
+  BroadcastRing(uint8_t* storage, size_t capacity) : m_buf(storage), m_capacity(capacity), m_head(0), m_reserved(0), m_lastPacket(0) {}
+
+  size_t capacity() const { return m_capacity; }
+
+  /// position just past the last complete packet; a new consumer starts reading here
+  size_t head() const { return m_head.load(std::memory_order_acquire); }
+
+  /// start of the newest complete packet, where a consumer that has been overrun resumes
+  size_t lastPacket() const { return m_lastPacket.load(std::memory_order_acquire); }
+
+  /// producer: append a header and its payload as one packet; only fails if the packet could never fit
+  bool write(const void* hdr, size_t hdrLen, const void* data, size_t len) {
+    if (hdrLen + len > m_capacity) return false;
+    const size_t head = m_head.load(std::memory_order_relaxed);
+
+    // announce the bytes about to be overwritten before touching them (seqlock style)
+    m_reserved.store(head + hdrLen + len, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    copyIn(head, static_cast<const uint8_t*>(hdr), hdrLen);
+    copyIn(head + hdrLen, static_cast<const uint8_t*>(data), len);
+    m_lastPacket.store(head, std::memory_order_release);
+    m_head.store(head + hdrLen + len, std::memory_order_release);
+    return true;
+  }
+
+  /// consumer: copy len bytes starting at pos; returns false if the producer has overwritten any of them
+  bool read(size_t pos, void* out, size_t len) const {
+    if (!intact(pos)) return false;
+    copyOut(pos, static_cast<uint8_t*>(out), len);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return m_reserved.load(std::memory_order_relaxed) <= pos + m_capacity;
+  }
+
+  /// consumer: true if the byte at pos has not been overwritten (yet)
+  bool intact(size_t pos) const {
+    return m_reserved.load(std::memory_order_acquire) <= pos + m_capacity;
+  }
+
+private:
+  BroadcastRing(const BroadcastRing&);
+  BroadcastRing& operator=(const BroadcastRing&);
+
+  void copyIn(size_t pos, const uint8_t* data, size_t len) {
+    size_t offset = pos % m_capacity;
+    size_t first = std::min(len, m_capacity - offset);
+    memcpy(m_buf + offset, data, first);
+    if (len > first) memcpy(m_buf, data + first, len - first);
+  }
+
+  void copyOut(size_t pos, uint8_t* out, size_t len) const {
+    size_t offset = pos % m_capacity;
+    size_t first = std::min(len, m_capacity - offset);
+    memcpy(out, m_buf + offset, first);
+    if (len > first) memcpy(out + first, m_buf, len - first);
+  }
+
+  uint8_t* m_buf;
+  const size_t m_capacity;
+
+  // written only by the producer, read by every consumer
+  char m_pad0[64];
+  std::atomic<size_t> m_head;
+  std::atomic<size_t> m_reserved;
+  std::atomic<size_t> m_lastPacket;
+  char m_pad1[64 - 3 * sizeof(std::atomic<size_t>)];
+};
+
+} // namespace drachtio
+
+#endif // __BROADCAST_RING_HPP__
@@ -0,0 +1,107 @@
+#ifndef __DNS_CACHE_HPP__
+#define __DNS_CACHE_HPP__
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <sys/socket.h>
+
+namespace drachtio {
+
+/// Caches the addresses websocket servers resolve to
+/**
+ * Shared by every service thread.  getaddrinfo doesn't report the record's TTL, so entries live
+ * for a fixed time, and callers forget a host whose cached address they failed to connect to so
+ * the next attempt resolves it again.  When a name resolves to several addresses they are handed
+ * out in turn.  Lookups that fail are not cached; the caller simply connects by name instead.
+ */
+class DnsCache {
+public:
+  explicit DnsCache(unsigned int ttlSecs) : m_ttl(std::chrono::seconds(ttlSecs)) {}
+
+  bool enabled() const { return m_ttl.count() > 0; }
+
+  /// the numeric address to connect to for host; returns false if it can't be resolved
+  bool lookup(const char* host, std::string& address) {
+    if (!enabled() || isNumeric(host)) return false;
+    const clock::time_point now = clock::now();
+    {
+      std::lock_guard<std::mutex> lk(m_mutex);
+      auto it = m_entries.find(host);
+      if (it != m_entries.end() && now < it->second.expires) {
+        entry& e = it->second;
+        address = e.addresses[e.next++ % e.addresses.size()];
+        return true;
+      }
+    }
+
+    // resolve without holding the lock, so one slow lookup doesn't hold up other threads' hits
+    entry e;
+    if (!resolve(host, e.addresses)) return false;
+    e.expires = now + m_ttl;
+    e.next = 1;
+    address = e.addresses[0];
+
+    std::lock_guard<std::mutex> lk(m_mutex);
+    m_entries[host] = e;
+    return true;
+  }
+
+  void forget(const char* host) {
+    if (!enabled()) return;
+    std::lock_guard<std::mutex> lk(m_mutex);
+    m_entries.erase(host);
+  }
+
+private:
+  typedef std::chrono::steady_clock clock;
+
+  struct entry {
+    std::vector<std::string> addresses;
+    clock::time_point expires;
+    size_t next;
+  };
+
+  static bool isNumeric(const char* host) {
+    unsigned char buf[sizeof(struct in6_addr)];
+    return inet_pton(AF_INET, host, buf) == 1 || inet_pton(AF_INET6, host, buf) == 1;
+  }
+
+  static bool resolve(const char* host, std::vector<std::string>& addresses) {
+    struct addrinfo hints, *result = nullptr;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (0 != getaddrinfo(host, nullptr, &hints, &result)) return false;
+
+    char buf[INET6_ADDRSTRLEN];
+    for (struct addrinfo* ai = result; ai; ai = ai->ai_next) {
+      const void* addr = ai->ai_family == AF_INET ?
+        (const void *) &((struct sockaddr_in *) ai->ai_addr)->sin_addr :
+        (const void *) &((struct sockaddr_in6 *) ai->ai_addr)->sin6_addr;
+      if ((ai->ai_family == AF_INET || ai->ai_family == AF_INET6) && inet_ntop(ai->ai_family, addr, buf, sizeof(buf))) {
+        if (std::find(addresses.begin(), addresses.end(), buf) == addresses.end()) addresses.push_back(buf);
+      }
+    }
+    freeaddrinfo(result);
+    return !addresses.empty();
+  }
+
+  DnsCache(const DnsCache&);
+  DnsCache& operator=(const DnsCache&);
+
+  const std::chrono::seconds m_ttl;
+  std::mutex m_mutex;
+  std::unordered_map<std::string, entry> m_entries;
+};
+
+} // namespace drachtio
+
+#endif // __DNS_CACHE_HPP__
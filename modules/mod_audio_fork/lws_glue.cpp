@@ -5,54 +5,474 @@
 #include <mutex>
 #include <thread>
 #include <list>
+#include <vector>
+#include <unordered_set>
+#include <unordered_map>
 #include <algorithm>
 #include <condition_variable>
+#include <atomic>
+#include <deque>
 #include <cassert>
 #include <cstdlib>
 #include <fstream>
+#include <new>
+#include <memory>
+#include <chrono>
+#include <climits>
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
 
 #include "base64.hpp"
 #include "parser.hpp"
+#include "broadcast_ring.hpp"
+#include "mpsc_queue.hpp"
+#include "audio_codec.hpp"
+#include "playback_buffer.hpp"
+#include "vad.hpp"
+#include "dns_cache.hpp"
+#include "trace_ring.hpp"
 #include "mod_audio_fork.h"
 
+extern "C" int parse_ws_uri(const char* szServerUri, char* host, char *path, unsigned int* pPort, int* pSslFlags);
+
 #define WS_TIMEOUT_MS    50
 #define RTP_PACKETIZATION_PERIOD 20
 #define FRAME_SIZE_8000  320 /*which means each 20ms frame as 320 bytes at 8 khz (1 channel only)*/
-
-#define WS_AUDIO_BUFFER_SIZE (FRAME_SIZE_16000 * 2 * 50 + LWS_PRE)  /* 50 frames at 20 ms packetization = 1 sec of audio, allow for 2 channels */
+#define RECV_BUF_INITIAL_SIZE 4096
+#define RECV_BUF_RETAIN_SIZE  65536 /* anything bigger (e.g. a playAudio payload) is released once processed */
+#define MUX_STREAM_ID_LEN 4  /* big-endian stream id in front of every binary frame on a multiplexed connection */
+#define FRAME_HEADER_LEN 20  /* in front of the audio in every binary frame when AUDIO_FORK_FRAMING is on */
+#define FRAME_HEADER_VERSION 1
+#define MAX_GROUP_ENDPOINTS 32  /* the endpoints a call has tried are kept in a 32 bit mask */
+#define DROP_LOG_INTERVAL_SECS 10  /* drops are traced and counted; the log gets the first and then a summary this often */
+#define TEARDOWN_POLL_USECS 1000000  /* how often a teardown waiting on a close looks for the shutdown deadline */
+
+/* per-frame events go to the trace rings rather than the log; build with -DAUDIO_FORK_NO_TRACE to compile them out */
+#if defined(AUDIO_FORK_NO_TRACE)
+#define FORK_TRACE(event, id, a, b) do {} while (0)
+#else
+#define FORK_TRACE(event, id, a, b) do { if (drachtio::TraceLog::enabled()) drachtio::TraceLog::record(event, id, a, b); } while (0)
+#endif
 
 namespace {
   static const char *requestedBufferSecs = std::getenv("MOD_AUDIO_FORK_BUFFER_SECS");
   static int nAudioBufferSecs = std::max(1, std::min(requestedBufferSecs ? ::atoi(requestedBufferSecs) : 2, 5));
   static const char *requestedNumServiceThreads = std::getenv("MOD_AUDIO_FORK_SERVICE_THREADS");
+  static const char *requestedAsyncConnect = std::getenv("MOD_AUDIO_FORK_ASYNC_CONNECT");
+  static const char *requestedFlushInterval = std::getenv("MOD_AUDIO_FORK_FLUSH_INTERVAL_MS");
+  static int nFlushIntervalMs = std::max(10, std::min(requestedFlushInterval ? ::atoi(requestedFlushInterval) : RTP_PACKETIZATION_PERIOD, 500));
+  static const char *requestedStreamingPlayback = std::getenv("MOD_AUDIO_FORK_STREAMING_PLAYBACK");
+  static const char *requestedPrebuffer = std::getenv("MOD_AUDIO_FORK_PLAYBACK_PREBUFFER_MS");
+  static int nPlaybackPrebufferMs = std::max(0, std::min(requestedPrebuffer ? ::atoi(requestedPrebuffer) : 60, 1000));
+  static const char *requestedPlayoutThreads = std::getenv("MOD_AUDIO_FORK_PLAYOUT_THREADS");
+  static unsigned int nPlayoutThreads = std::max(1, std::min(requestedPlayoutThreads ? ::atoi(requestedPlayoutThreads) : 2, 8));
   static const char* mySubProtocolName = std::getenv("MOD_AUDIO_FORK_SUBPROTOCOL_NAME") ?
     std::getenv("MOD_AUDIO_FORK_SUBPROTOCOL_NAME") : "audiostream.drachtio.org";
+  static const char *requestedReconnectAttempts = std::getenv("MOD_AUDIO_FORK_RECONNECT_ATTEMPTS");
+  static const char *requestedReconnectBackoff = std::getenv("MOD_AUDIO_FORK_RECONNECT_BACKOFF_MS");
+  static int nReconnectBackoffMs = std::max(50, std::min(requestedReconnectBackoff ? ::atoi(requestedReconnectBackoff) : 500, 10000));
+  static const char *requestedReconnectMaxBackoff = std::getenv("MOD_AUDIO_FORK_RECONNECT_MAX_BACKOFF_MS");
+  static int nReconnectMaxBackoffMs = std::max(nReconnectBackoffMs, 
+    std::min(requestedReconnectMaxBackoff ? ::atoi(requestedReconnectMaxBackoff) : 30000, 300000));
+  static const char *requestedReplayBufferSecs = std::getenv("MOD_AUDIO_FORK_RECONNECT_BUFFER_SECS");
+  static int nReplayBufferSecs = std::max(1, std::min(requestedReplayBufferSecs ? ::atoi(requestedReplayBufferSecs) : 5, 30));
+  static const char *requestedMaxBacklog = std::getenv("MOD_AUDIO_FORK_MAX_BACKLOG_MS");
+  static int nMaxBacklogMs = requestedMaxBacklog && ::atoi(requestedMaxBacklog) > 0 ? 
+    std::max(100, std::min(::atoi(requestedMaxBacklog), 30000)) : 0;
+  static const char *requestedDropPolicy = std::getenv("MOD_AUDIO_FORK_DROP_POLICY");
+  static bool dropNewest = requestedDropPolicy && 0 == strcasecmp(requestedDropPolicy, "newest");
+  static const char* myMuxSubProtocolName = std::getenv("MOD_AUDIO_FORK_MULTIPLEX_SUBPROTOCOL_NAME") ?
+    std::getenv("MOD_AUDIO_FORK_MULTIPLEX_SUBPROTOCOL_NAME") : "mux.audiostream.drachtio.org";
+  static const char *requestedMultiplex = std::getenv("MOD_AUDIO_FORK_MULTIPLEX");
+  static const char *requestedMuxStreams = std::getenv("MOD_AUDIO_FORK_MULTIPLEX_STREAMS");
+  static const char *requestedFraming = std::getenv("MOD_AUDIO_FORK_FRAMING");
+  static const char *requestedFrameMs = std::getenv("MOD_AUDIO_FORK_FRAME_MS");
+  static const char *requestedVad = std::getenv("MOD_AUDIO_FORK_VAD");
+  static const char *requestedVadThreshold = std::getenv("MOD_AUDIO_FORK_VAD_THRESHOLD_DB");
+  static int nVadThresholdDb = std::max(-90, std::min(requestedVadThreshold ? ::atoi(requestedVadThreshold) : -40, 0));
+  static const char *requestedVadHangover = std::getenv("MOD_AUDIO_FORK_VAD_HANGOVER_MS");
+  static int nVadHangoverMs = std::max(0, std::min(requestedVadHangover ? ::atoi(requestedVadHangover) : 500, 5000));
+  static const char *requestedVadPreroll = std::getenv("MOD_AUDIO_FORK_VAD_PREROLL_MS");
+  static int nVadPrerollMs = std::max(0, std::min(requestedVadPreroll ? ::atoi(requestedVadPreroll) : 200, 1000));
+  static size_t nMaxMuxStreams = std::max(1, std::min(requestedMuxStreams ? ::atoi(requestedMuxStreams) : 100, 1000));
   static int interrupted = 0;
-  static unsigned int nServiceThreads = std::max(1, std::min(requestedNumServiceThreads ? ::atoi(requestedNumServiceThreads) : 1, 5));
-  static struct lws_context *context[5] = {NULL, NULL, NULL, NULL, NULL};
+  static unsigned int nCores = std::max(1u, std::thread::hardware_concurrency());
+  static unsigned int nServiceThreads = requestedNumServiceThreads && 0 == strcasecmp(requestedNumServiceThreads, "auto") ? nCores :
+    (unsigned int) std::max(1, std::min(requestedNumServiceThreads ? ::atoi(requestedNumServiceThreads) : 1, (int) nCores));
+  static const char *requestedAffinity = std::getenv("MOD_AUDIO_FORK_SERVICE_THREAD_AFFINITY");
+  static const char *requestedPrewarmUrls = std::getenv("MOD_AUDIO_FORK_PREWARM_URLS");
+  static const char *requestedPrewarmConnections = std::getenv("MOD_AUDIO_FORK_PREWARM_CONNECTIONS");
+  static const char *requestedDnsTtl = std::getenv("MOD_AUDIO_FORK_DNS_CACHE_TTL_SECS");
+  static unsigned int nDnsTtlSecs = std::max(0, std::min(requestedDnsTtl ? ::atoi(requestedDnsTtl) : 60, 3600));
+  static const char *requestedTlsSessions = std::getenv("MOD_AUDIO_FORK_TLS_SESSION_CACHE");
+  static unsigned int nTlsSessions = std::max(1, std::min(requestedTlsSessions ? ::atoi(requestedTlsSessions) : 100, 10000));
+  static size_t nPrewarmConnections = std::max(1, std::min(requestedPrewarmConnections ? ::atoi(requestedPrewarmConnections) : 2, 50));
+  static const char *requestedTrace = std::getenv("MOD_AUDIO_FORK_TRACE");
+  static const char *requestedTraceEntries = std::getenv("MOD_AUDIO_FORK_TRACE_ENTRIES");
+  static int nTraceEntries = std::max(256, std::min(requestedTraceEntries ? ::atoi(requestedTraceEntries) : 4096, 1048576));
+  static const char *requestedDrainTimeout = std::getenv("MOD_AUDIO_FORK_DRAIN_TIMEOUT_MS");
+  static int nDrainTimeoutMs = std::max(0, std::min(requestedDrainTimeout ? ::atoi(requestedDrainTimeout) : 5000, 60000));
+
+  enum {
+    WORK_CONNECT,
+    WORK_WRITE,
+    WORK_DISCONNECT,
+    WORK_ABORT
+  };
+
+  struct work_item {
+    int type;
+    private_t* tech_pvt;
+  };
+
+  struct service_ctx;
+
+  /**
+   * Counters for the stats api.  Each one has a single writer (the media thread for the capture,
+   * a connection's service thread for everything else) and is read without locking, so relaxed
+   * atomics are all it takes; the module-wide totals are shared by every thread.
+   */
+  struct fork_stats {
+    std::atomic<uint64_t> framesCaptured;
+    std::atomic<uint64_t> bytesCaptured;
+    std::atomic<uint64_t> captureDrops;
+    std::atomic<uint64_t> framesSuppressed;
+    std::atomic<uint64_t> messagesSent;
+    std::atomic<uint64_t> bytesSent;
+    std::atomic<uint64_t> bytesDropped;
+    std::atomic<uint64_t> drops;
+    std::atomic<uint64_t> backlogHighWater;
+    std::atomic<uint64_t> writeNanos;
+    std::atomic<uint64_t> writeNanosMax;
+    std::atomic<uint64_t> reconnects;
+  };
+  static fork_stats totals;
+
+  enum {
+    TRACE_CAPTURED,       // a: samples, b: bytes written to the ring
+    TRACE_CAPTURE_DROP,   // a: samples, b: bytes that didn't fit
+    TRACE_WRITEABLE,      // a: ws state
+    TRACE_AUDIO_READ,     // a: bytes of audio, b: bytes in the frame
+    TRACE_SEND_DROP,      // a: bytes of backlog dropped, b: bytes dropped so far
+    TRACE_TEXT_SENT,      // a: bytes
+  };
+
+  const char* traceEventName(uint32_t event) {
+    switch (event) {
+      case TRACE_CAPTURED: return "captured";
+      case TRACE_CAPTURE_DROP: return "capture_drop";
+      case TRACE_WRITEABLE: return "writeable";
+      case TRACE_AUDIO_READ: return "audio_read";
+      case TRACE_SEND_DROP: return "send_drop";
+      case TRACE_TEXT_SENT: return "text_sent";
+    }
+    return "unknown";
+  }
+  static std::atomic<int> activeCalls(0);
+
+  /* set by audio_fork_drain or on shutdown: no new forks are started, the ones in progress carry on */
+  static std::atomic<bool> draining(false);
+  static std::atomic<switch_time_t> teardownDeadline(0);  // set on shutdown: closes still in progress after this are cut short
+  static std::mutex liveForksMutex;
+  static std::condition_variable liveForksStopped;
+  // uuids of the calls being forked, for the drain on shutdown, and whether their teardown has begun:
+  // whoever flips that first (a stop, the call ending or the drain) is the only one to tear the fork down
+  static std::unordered_map<std::string, bool> liveForks;
+
+  inline void bump(std::atomic<uint64_t>& counter, uint64_t n) {
+    counter.fetch_add(n, std::memory_order_relaxed);
+  }
+
+  inline void highWater(std::atomic<uint64_t>& mark, uint64_t n) {
+    uint64_t current = mark.load(std::memory_order_relaxed);
+    while (n > current && !mark.compare_exchange_weak(current, n, std::memory_order_relaxed)) ;
+  }
+
+  inline fork_stats* statsOf(private_t* tech_pvt) {
+    return static_cast<fork_stats*>(tech_pvt->stats);
+  }
+
+  /* outbound text frames: any thread may queue one, only the connection's service thread sends them */
+  struct text_fifo {
+    drachtio::MpscQueue<std::string> queued;
+    std::vector<std::string> batch;
+    std::deque<std::string> pending;   // taken off the queue but not yet sent, oldest first
+    std::string initial;               // the first frame on every connection, sent again after a reconnect
+  };
+
+  /* a websocket shared by every stream to the same url on one service thread, see MOD_AUDIO_FORK_MULTIPLEX */
+  struct mux_connection {
+    std::string key;
+    char host[MAX_WS_URL_LEN];
+    unsigned int port;
+    char path[MAX_PATH_LEN];
+    int sslFlags;
+    struct lws *wsi;
+    int state;
+    bool connecting;     // lws_client_connect_via_info is still on the stack
+    bool failed;         // ...and has already reported a connection error
+    std::vector<private_t*> streams;
+    std::unordered_map<uint32_t, private_t*> byId;
+    size_t next;         // round robin position, so one busy stream can't starve the others
+    std::vector<uint8_t> recv;
+  };
+
+  struct destination_group;
+
+  /* one websocket server in a destination group from audio_fork.conf.xml; shared by every thread */
+  struct group_endpoint {
+    destination_group* group;
+    std::string url;
+    char host[MAX_WS_URL_LEN];
+    unsigned int port;
+    char path[MAX_PATH_LEN];
+    int sslFlags;
+    unsigned int index;
+    std::atomic<int> active;               // calls currently assigned to it
+    std::atomic<int> failures;             // consecutive failed connects
+    std::atomic<switch_time_t> downUntil;  // considered unhealthy until then
+  };
+
+  struct destination_group {
+    std::string name;
+    bool hashByUuid;    // else least connections
+    std::vector<std::unique_ptr<group_endpoint>> endpoints;
+  };
+
+  /* an active health check of one endpoint, run by the first service thread */
+  struct health_probe {
+    group_endpoint* endpoint;
+    bool inFlight;
+    bool starting;
+    bool startFailed;
+    switch_time_t nextCheck;
+  };
+
+  /* idle connections opened ahead of time to one of MOD_AUDIO_FORK_PREWARM_URLS, handed to sessions by connect_client */
+  struct warm_pool {
+    std::string key;
+    char host[MAX_WS_URL_LEN];
+    unsigned int port;
+    char path[MAX_PATH_LEN];
+    int sslFlags;
+    std::deque<struct lws*> idle;   // upgraded and waiting for a session
+    size_t connecting;
+    bool starting;       // lws_client_connect_via_info is still on the stack
+    bool startFailed;    // ...and has already reported a connection error
+    switch_time_t retryAt;
+  };
+
+#if LWS_LIBRARY_VERSION_MAJOR >= 4
+  struct flush_timer {
+    lws_sorted_usec_list_t sul;
+    service_ctx* ctx;
+  };
+#endif
+
+  /* each lws context is owned by a single service thread, and only ever sees work for its own connections */
+  struct service_ctx {
+    std::atomic<struct lws_context*> context;   // set by the service thread while it is running, read by any thread
+    drachtio::MpscQueue<work_item> work;
+    std::vector<work_item> scratch;   // only touched by the service thread
+    std::unordered_set<private_t*> connections;  // established connections, only touched by the service thread
+    std::unordered_map<std::string, std::vector<mux_connection*>> muxes;  // shared connections still taking streams, by url
+    std::vector<std::pair<switch_time_t, private_t*> > reconnects;  // waiting out their backoff, only touched by the service thread
+    std::vector<warm_pool> pools;     // built before the context is created and never resized, see poolOf
+    std::vector<health_probe> probes; // likewise, see probeOf
+    struct lws_per_vhost_data* vhd;
+    switch_time_t nextFlush;
+#if LWS_LIBRARY_VERSION_MAJOR >= 4
+    flush_timer timer;
+#endif
+    // published every flush for the stats api
+    std::atomic<unsigned int> nConnections;
+    std::atomic<unsigned int> nShared;
+    std::atomic<unsigned int> nReconnecting;
+    std::atomic<unsigned int> nWarm;
+    // destinations assigned to this thread, kept by the sessions for least-loaded assignment
+    std::atomic<unsigned int> nAssigned;
+  };
+  static std::unique_ptr<service_ctx[]> services(new service_ctx[nServiceThreads]());
+
+  // started by fork_service_threads, joined (or given up on) by fork_cleanup
+  static std::atomic<bool> stopServices(false);
+  static std::mutex serviceThreadsMutex;
+  static std::condition_variable serviceThreadsExited;
+  static std::vector<std::thread> serviceThreads;
+  static unsigned int nRunningServiceThreads = 0;
+  static drachtio::DnsCache dnsCache(nDnsTtlSecs);
+
+  // loaded from audio_fork.conf.xml by fork_init, before any service thread starts, and read-only afterwards
+  static std::unordered_map<std::string, std::unique_ptr<destination_group>> groups;
+  static int nGroupFailureThreshold = 3;
+  static int nGroupDownTimeMs = 10000;
+  static int nHealthCheckIntervalMs = 0;
+
+  /**
+   * Destination groups: "group:<name>" in place of a url forks to one of the group's endpoints,
+   * picked either by least connections or by hashing the call's uuid (rendezvous hashing, so each
+   * call keeps its endpoint when others come and go, on every media server).  An endpoint that
+   * fails nGroupFailureThreshold connects in a row (passive) or an active health check is left out
+   * for nGroupDownTimeMs; when a connect fails the call fails over to an endpoint it hasn't tried.
+   */
+  uint64_t fnv1a(const std::string& s, uint64_t hash = 14695981039346656037ULL) {
+    for (size_t i = 0; i < s.size(); i++) {
+      hash ^= (unsigned char) s[i];
+      hash *= 1099511628211ULL;
+    }
+    return hash;
+  }
+
+  bool endpointHealthy(const group_endpoint* ep, switch_time_t now) {
+    return ep->downUntil.load(std::memory_order_relaxed) <= now;
+  }
+
+  void endpointSucceeded(group_endpoint* ep) {
+    ep->failures.store(0, std::memory_order_relaxed);
+    if (ep->downUntil.exchange(0, std::memory_order_relaxed) > switch_micro_time_now()) {
+      switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "mod_audio_fork: group endpoint %s is healthy again\n", ep->url.c_str());
+    }
+  }
+
+  void endpointFailed(group_endpoint* ep) {
+    if (++ep->failures < nGroupFailureThreshold) return;
+    switch_time_t now = switch_micro_time_now();
+    if (endpointHealthy(ep, now)) {
+      switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "mod_audio_fork: group endpoint %s marked down after %d failures\n", 
+        ep->url.c_str(), ep->failures.load());
+    }
+    ep->downUntil.store(now + (switch_time_t) nGroupDownTimeMs * 1000, std::memory_order_relaxed);
+  }
+
+  /* the endpoint a call should use next, skipping those it has tried; unhealthy ones only if nothing else is left */
+  group_endpoint* selectEndpoint(destination_group* group, const char* uuid, uint32_t tried) {
+    switch_time_t now = switch_micro_time_now();
+    for (int pass = 0; pass < 2; pass++) {
+      group_endpoint* best = nullptr;
+      uint64_t bestScore = 0;
+      for (auto it = group->endpoints.begin(); it != group->endpoints.end(); ++it) {
+        group_endpoint* ep = it->get();
+        if (tried & (1u << ep->index)) continue;
+        if (pass == 0 && !endpointHealthy(ep, now)) continue;
+        uint64_t score = group->hashByUuid ? fnv1a(ep->url, fnv1a(uuid)) : 
+          UINT64_MAX - (uint64_t) std::max(0, ep->active.load(std::memory_order_relaxed));
+        if (!best || score > bestScore) {
+          best = ep;
+          bestScore = score;
+        }
+      }
+      if (best) return best;
+    }
+    return nullptr;
+  }
+
+  void assignEndpoint(private_t* tech_pvt, group_endpoint* ep) {
+    group_endpoint* previous = static_cast<group_endpoint*>(tech_pvt->endpoint);
+    if (previous) previous->active--;
+    ep->active++;
+    tech_pvt->endpoint = ep;
+    tech_pvt->endpoints_tried |= 1u << ep->index;
+    strncpy(tech_pvt->host, ep->host, MAX_WS_URL_LEN);
+    tech_pvt->port = ep->port;
+    strncpy(tech_pvt->path, ep->path, MAX_PATH_LEN);
+    tech_pvt->sslFlags = ep->sslFlags;
+  }
+
+  destination_group* groupOf(private_t* tech_pvt) {
+    group_endpoint* ep = static_cast<group_endpoint*>(tech_pvt->endpoint);
+    return ep ? ep->group : nullptr;
+  }
+
+  /* the first endpoint for a call forked to "group:<name>" */
+  bool joinGroup(switch_core_session_t *session, private_t* tech_pvt, const char* name) {
+    auto it = groups.find(name);
+    if (it == groups.end()) {
+      switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR, "(%u) unknown destination group %s\n", tech_pvt->id, name);
+      return false;
+    }
+    group_endpoint* ep = selectEndpoint(it->second.get(), tech_pvt->sessionId, 0);
+    if (!ep) return false;
+    assignEndpoint(tech_pvt, ep);
+    switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_DEBUG, "(%u) group %s: using %s\n", tech_pvt->id, name, ep->url.c_str());
+    return true;
+  }
+
+  void loadGroups() {
+    switch_xml_t cfg, xml = switch_xml_open_cfg("audio_fork.conf", &cfg, NULL);
+    if (!xml) {
+      switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "mod_audio_fork: no audio_fork.conf, destination groups are not available\n");
+      return;
+    }
+
+    switch_xml_t settings = switch_xml_child(cfg, "settings");
+    for (switch_xml_t param = settings ? switch_xml_child(settings, "param") : NULL; param; param = param->next) {
+      const char* name = switch_xml_attr_soft(param, "name");
+      int value = ::atoi(switch_xml_attr_soft(param, "value"));
+      if (!strcasecmp(name, "failure-threshold")) nGroupFailureThreshold = std::max(1, std::min(value, 100));
+      else if (!strcasecmp(name, "down-time-ms")) nGroupDownTimeMs = std::max(1000, std::min(value, 600000));
+      else if (!strcasecmp(name, "health-check-interval-ms")) nHealthCheckIntervalMs = value > 0 ? std::max(1000, std::min(value, 600000)) : 0;
+      else switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "mod_audio_fork: unknown param %s in audio_fork.conf\n", name);
+    }
+
+    switch_xml_t xgroups = switch_xml_child(cfg, "groups");
+    for (switch_xml_t xgroup = xgroups ? switch_xml_child(xgroups, "group") : NULL; xgroup; xgroup = xgroup->next) {
+      std::unique_ptr<destination_group> group(new destination_group);
+      group->name = switch_xml_attr_soft(xgroup, "name");
+      group->hashByUuid = 0 == strcasecmp(switch_xml_attr_soft(xgroup, "policy"), "hash");
+      for (switch_xml_t xdest = switch_xml_child(xgroup, "destination"); xdest; xdest = xdest->next) {
+        std::unique_ptr<group_endpoint> ep(new group_endpoint);
+        ep->group = group.get();
+        ep->url = switch_xml_attr_soft(xdest, "url");
+        if (!parse_ws_uri(ep->url.c_str(), ep->host, ep->path, &ep->port, &ep->sslFlags)) {
+          switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "mod_audio_fork: invalid url '%s' in group %s\n", ep->url.c_str(), group->name.c_str());
+          continue;
+        }
+        if (group->endpoints.size() == MAX_GROUP_ENDPOINTS) {
+          switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "mod_audio_fork: group %s has more than %d destinations, ignoring %s\n", 
+            group->name.c_str(), MAX_GROUP_ENDPOINTS, ep->url.c_str());
+          continue;
+        }
+        ep->index = group->endpoints.size();
+        ep->active = 0;
+        ep->failures = 0;
+        ep->downUntil = 0;
+        group->endpoints.push_back(std::move(ep));
+      }
+      if (group->name.empty() || group->endpoints.empty()) {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "mod_audio_fork: ignoring group '%s' without a name or destinations\n", group->name.c_str());
+        continue;
+      }
+      switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "mod_audio_fork: group %s has %lu destinations, selected by %s\n", 
+        group->name.c_str(), group->endpoints.size(), group->hashByUuid ? "uuid hash" : "least connections");
+      std::string name = group->name;
+      groups[name] = std::move(group);
+    }
+    switch_xml_free(xml);
+  }
+
+  /* a connect worked: the endpoint is healthy, and should this call lose it later every endpoint is worth trying again */
+  void groupConnected(private_t* tech_pvt) {
+    group_endpoint* ep = static_cast<group_endpoint*>(tech_pvt->endpoint);
+    if (!ep) return;
+    endpointSucceeded(ep);
+    tech_pvt->endpoints_tried = 1u << ep->index;
+  }
 
   static unsigned int idxCallCount = 0;
-  static std::list<private_t*> pendingConnects;
-  static std::list<private_t*> pendingDisconnects;
-  static std::list<private_t*> pendingWrites;
-  static std::mutex g_mutex_connects;
-  static std::mutex g_mutex_disconnects;
-  static std::mutex g_mutex_writes;
-  static uint32_t playCount = 0;
+  static std::atomic<uint32_t> playCount(0);
 
-  void initAudioBuffer(private_t *tech_pvt) {
-    tech_pvt->ws_audio_buffer_write_offset = LWS_PRE;
-    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "(%u) reset write offset to start: %lu\n", 
-      tech_pvt->id, tech_pvt->ws_audio_buffer_write_offset);
+  size_t audioBufferLen(int sampling, int channels, int secs) {
+    return (FRAME_SIZE_8000 * sampling / 8000 * channels + sizeof(drachtio::audio_packet_header)) * 
+      1000 / RTP_PACKETIZATION_PERIOD * secs;
   }
 
-  switch_status_t fork_data_init(private_t *tech_pvt, switch_core_session_t *session, char * host, 
-    unsigned int port, char* path, int sslFlags, int sampling, int desiredSampling, int channels, char* metadata, responseHandler_t responseHandler) {
+  /* per-destination state: one of these for every websocket the capture is forked to */
+  switch_status_t fork_data_init(private_t *tech_pvt, private_t *capture, switch_core_session_t *session, char * host, 
+    unsigned int port, char* path, int sslFlags, int desiredSampling, int codec, int channels, responseHandler_t responseHandler) {
 
-    int err;
-    switch_codec_implementation_t read_impl;
-    switch_core_session_get_read_impl(session, &read_impl);
-  
     memset(tech_pvt, 0, sizeof(private_t));
   
     strncpy(tech_pvt->sessionId, switch_core_session_get_uuid(session), MAX_SESSION_ID);
@@ -63,28 +483,59 @@ namespace {
     tech_pvt->sslFlags = sslFlags;
     tech_pvt->wsi = NULL;
     tech_pvt->vhd = NULL;
-    tech_pvt->metadata = NULL;
     tech_pvt->sampling = desiredSampling;
+    tech_pvt->codec = codec;
     tech_pvt->responseHandler = responseHandler;
     tech_pvt->playout = NULL;
     tech_pvt->channels = channels;
     tech_pvt->id = ++idxCallCount;
-
-    tech_pvt->ws_audio_buffer_max_len = LWS_PRE +
-      (FRAME_SIZE_8000 * desiredSampling / 8000 * channels * 1000 / RTP_PACKETIZATION_PERIOD * nAudioBufferSecs);
-    tech_pvt->ws_audio_buffer = (uint8_t *) malloc(tech_pvt->ws_audio_buffer_max_len);
-    if (nullptr == tech_pvt->ws_audio_buffer) {
-      switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR, "Error allocating audio buffer\n");
+    tech_pvt->capture = capture ? capture : tech_pvt;
+
+    // the send buffer comes from the session pool so that the lws thread can never touch freed memory,
+    // no matter which side tears the connection down
+    tech_pvt->ws_send_buffer_len = LWS_PRE + audioBufferLen(desiredSampling, channels, nAudioBufferSecs);
+    tech_pvt->ws_send_buffer = (uint8_t *) switch_core_session_alloc(session, tech_pvt->ws_send_buffer_len);
+    if (!tech_pvt->ws_send_buffer) {
+      switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR, "Error allocating send buffer\n");
       return SWITCH_STATUS_FALSE;
     }
-    tech_pvt->ws_audio_buffer_min_freespace = read_impl.decoded_bytes_per_packet;
-    initAudioBuffer(tech_pvt);
+    tech_pvt->text_fifo = new text_fifo;
+    void* statsMem = switch_core_session_alloc(session, sizeof(fork_stats));
+    if (!statsMem) {
+      switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR, "Error allocating stats\n");
+      return SWITCH_STATUS_FALSE;
+    }
+    tech_pvt->stats = new (statsMem) fork_stats();
+    tech_pvt->text_turn = 1;
 
-    switch_mutex_init(&tech_pvt->ws_send_mutex, SWITCH_MUTEX_DEFAULT, switch_core_session_get_pool(session));
     switch_mutex_init(&tech_pvt->ws_recv_mutex, SWITCH_MUTEX_DEFAULT, switch_core_session_get_pool(session));
     switch_mutex_init(&tech_pvt->mutex, SWITCH_MUTEX_NESTED, switch_core_session_get_pool(session));
     switch_thread_cond_create(&tech_pvt->cond, switch_core_session_get_pool(session));
 
+    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "(%u) fork_data_init\n", tech_pvt->id);
+
+    return SWITCH_STATUS_SUCCESS;
+  }
+
+  /* per-capture state, held by the first destination: audio is read, resampled and encoded once for all of them */
+  switch_status_t capture_init(private_t *tech_pvt, switch_core_session_t *session, int sampling) {
+    int desiredSampling = tech_pvt->sampling;
+    int channels = tech_pvt->channels;
+    int codec = tech_pvt->codec;
+    int err;
+
+    // the ring also comes from the session pool, since every destination's lws thread reads from it;
+    // when reconnecting is enabled it doubles as the replay buffer, and is sized for that
+    int secs = tech_pvt->max_reconnects > 0 ? std::max(nAudioBufferSecs, nReplayBufferSecs) : nAudioBufferSecs;
+    size_t ringLen = audioBufferLen(desiredSampling, channels, secs);
+    void *ringMem = switch_core_session_alloc(session, sizeof(drachtio::BroadcastRing));
+    uint8_t *ringStorage = (uint8_t *) switch_core_session_alloc(session, ringLen);
+    if (!ringMem || !ringStorage) {
+      switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR, "Error allocating audio buffer\n");
+      return SWITCH_STATUS_FALSE;
+    }
+    tech_pvt->audio_ring = new (ringMem) drachtio::BroadcastRing(ringStorage, ringLen);
+
     if (desiredSampling != sampling) {
       switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "(%u) resampling from %u to %u\n", tech_pvt->id, sampling, desiredSampling);
       tech_pvt->resampler = speex_resampler_init(channels, sampling, desiredSampling, SWITCH_RESAMPLE_QUALITY, &err);
@@ -97,17 +548,50 @@ namespace {
       switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "(%u) no resampling needed for this call\n", tech_pvt->id);
     }
 
-    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "(%u) fork_data_init\n", tech_pvt->id);
+    if (AUDIO_FORK_CODEC_L16 != codec) {
+      std::string error;
+      drachtio::AudioEncoder* encoder = drachtio::AudioEncoder::create(codec, desiredSampling, channels, error);
+      if (!encoder) {
+        switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR, "Error initializing %s encoder: %s.\n", 
+          drachtio::audio_codec_name(codec), error.c_str());
+        return SWITCH_STATUS_FALSE;
+      }
+      tech_pvt->encoder = encoder;
+      tech_pvt->message_per_packet = encoder->framed();
+
+      // kept where the lws threads can get at it for as long as the session lives
+      std::vector<uint8_t> header = encoder->streamHeader();
+      if (!header.empty()) {
+        tech_pvt->stream_header = (uint8_t *) switch_core_session_alloc(session, header.size());
+        memcpy(tech_pvt->stream_header, &header[0], header.size());
+        tech_pvt->stream_header_len = header.size();
+      }
+      switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "(%u) encoding audio as %s\n", tech_pvt->id, drachtio::audio_codec_name(codec));
+    }
 
     return SWITCH_STATUS_SUCCESS;
   }
 
   void destroy_tech_pvt(private_t* tech_pvt) {
     switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "(%u) destroy_tech_pvt\n", tech_pvt->id);
+    if (tech_pvt->service_assigned) {
+      services[tech_pvt->service_thread].nAssigned--;
+      tech_pvt->service_assigned = 0;
+    }
+    if (tech_pvt->endpoint) {
+      static_cast<group_endpoint*>(tech_pvt->endpoint)->active--;
+      tech_pvt->endpoint = nullptr;
+    }
     tech_pvt->ws_state = LWS_CLIENT_DISCONNECTED;
-    if (tech_pvt->resampler) {
-      speex_resampler_destroy(tech_pvt->resampler);
-      tech_pvt->resampler = nullptr;
+    if (tech_pvt->text_fifo) {
+      delete static_cast<text_fifo*>(tech_pvt->text_fifo);
+      tech_pvt->text_fifo = nullptr;
+    }
+    if (tech_pvt->recv_buf) {
+      delete [] tech_pvt->recv_buf;
+      tech_pvt->recv_buf = nullptr;
+      tech_pvt->recv_buf_ptr = nullptr;
+      tech_pvt->recv_buf_len = 0;
     }
     if (tech_pvt->mutex) {
       switch_mutex_destroy(tech_pvt->mutex);
@@ -118,311 +602,1447 @@ namespace {
       tech_pvt->cond = nullptr;
     }
     tech_pvt->wsi = nullptr;
-    if (tech_pvt->ws_audio_buffer) {
-      free(tech_pvt->ws_audio_buffer);
-      tech_pvt->ws_audio_buffer = nullptr;
-      tech_pvt->ws_audio_buffer_max_len = tech_pvt->ws_audio_buffer_write_offset = 0;
+  }
+
+  // only safe once fork_frame() can no longer run, i.e. the media bug is closed or was never added
+  void release_dsp(private_t* tech_pvt) {
+    if (tech_pvt->resampler) {
+      speex_resampler_destroy(tech_pvt->resampler);
+      tech_pvt->resampler = nullptr;
+    }
+    if (tech_pvt->encoder) {
+      delete static_cast<drachtio::AudioEncoder*>(tech_pvt->encoder);
+      tech_pvt->encoder = nullptr;
+    }
+    if (tech_pvt->playback) {
+      delete static_cast<drachtio::PlaybackBuffer*>(tech_pvt->playback);
+      tech_pvt->playback = nullptr;
+    }
+    if (tech_pvt->vad) {
+      delete static_cast<drachtio::EnergyVad*>(tech_pvt->vad);
+      tech_pvt->vad = nullptr;
     }
   }
 
-	uint32_t bumpPlayCount(void) { return ++playCount; }
+  bool writePacket(private_t* tech_pvt, const uint8_t* data, size_t len, uint32_t samples, int64_t captured) {
+    drachtio::BroadcastRing* ring = static_cast<drachtio::BroadcastRing*>(tech_pvt->capture->audio_ring);
+    drachtio::audio_packet_header hdr = { (uint32_t) len, samples, tech_pvt->capture->sequence, captured };
+    fork_stats* stats = statsOf(tech_pvt->capture);
+    if (!ring->write(&hdr, sizeof(hdr), data, len)) {
+      bump(stats->captureDrops, 1);
+      bump(totals.captureDrops, 1);
+      return false;
+    }
+    tech_pvt->capture->sequence++;
+    bump(stats->bytesCaptured, len);
+    bump(totals.bytesCaptured, len);
+    return true;
+  }
 
-  void addPendingConnect(private_t* tech_pvt) {
-    std::lock_guard<std::mutex> guard(g_mutex_connects);
-    tech_pvt->ws_state = LWS_CLIENT_IDLE;
-    pendingConnects.push_back(tech_pvt);
-    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "(%u) there are now %lu pending connections\n", tech_pvt->id, pendingConnects.size());
+  /* hand a frame of audio to lws, timing it; lws holds on to whatever the socket would not take,
+     so a short count means the connection is broken */
+  bool writeAudio(private_t* tech_pvt, struct lws *wsi, uint8_t* frame, size_t len, size_t audioLen) {
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    int sent = lws_write(wsi, frame, len, LWS_WRITE_BINARY);
+    uint64_t nanos = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+    if (sent < (int) len) {
+      switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "(%u) wrote only %d of %lu bytes of audio wsi: %p\n", tech_pvt->id, sent, len, wsi);
+      return false;
+    }
+
+    fork_stats* stats = statsOf(tech_pvt);
+    bump(stats->messagesSent, 1);
+    bump(stats->bytesSent, audioLen);
+    bump(stats->writeNanos, nanos);
+    highWater(stats->writeNanosMax, nanos);
+    bump(totals.messagesSent, 1);
+    bump(totals.bytesSent, audioLen);
+    bump(totals.writeNanos, nanos);
+    highWater(totals.writeNanosMax, nanos);
+    return true;
   }
 
-  void addPendingDisconnect(private_t* tech_pvt) {
-    std::lock_guard<std::mutex> guard(g_mutex_disconnects);
-    tech_pvt->ws_state = LWS_CLIENT_DISCONNECTING;
-    pendingDisconnects.push_back(tech_pvt);
-    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "(%u) there are now %lu pending disconnects\n", tech_pvt->id, pendingDisconnects.size());
+  /* true once there is a message's worth of audio to send: anything at all, or with a frame size a full frame
+     (unless partial, when the connection is closing and a trailing partial frame goes too) */
+  bool hasAudio(private_t* tech_pvt, bool partial = false) {
+    drachtio::BroadcastRing* ring = static_cast<drachtio::BroadcastRing*>(tech_pvt->capture->audio_ring);
+    const size_t head = ring->head();
+    if (head == tech_pvt->audio_cursor) return false;
+    if (!tech_pvt->frame_samples || partial) return true;
+
+    drachtio::audio_packet_header hdr;
+    uint32_t samples = 0;
+    for (size_t pos = tech_pvt->audio_cursor; pos != head; pos += sizeof(hdr) + hdr.len) {
+      // overrun: let readPackets find out and skip ahead
+      if (!ring->read(pos, &hdr, sizeof(hdr))) return true;
+      samples += hdr.samples;
+      if (samples >= tech_pvt->frame_samples) return true;
+    }
+    return false;
   }
 
-  void addPendingWrite(private_t* tech_pvt) {
-    std::lock_guard<std::mutex> guard(g_mutex_writes);
-    pendingWrites.push_back(tech_pvt);
+  /* a far end we reconnected to needs the codec's stream header again before any more audio */
+  size_t readStreamHeader(private_t* tech_pvt, uint8_t* out, size_t maxLen) {
+    private_t* capture = tech_pvt->capture;
+    tech_pvt->resend_header = 0;
+    if (!capture->stream_header_len || capture->stream_header_len > maxLen) return 0;
+    memcpy(out, capture->stream_header, capture->stream_header_len);
+    return capture->stream_header_len;
   }
 
-  private_t* findAndRemovePendingConnect(struct lws *wsi) {
-    private_t* tech_pvt = NULL;
-    std::lock_guard<std::mutex> guard(g_mutex_connects);
+  /* true for the first drop and then at most once per DROP_LOG_INTERVAL_SECS */
+  bool dropLogDue(switch_time_t& logged) {
+    switch_time_t now = switch_micro_time_now();
+    if (logged && now - logged < DROP_LOG_INTERVAL_SECS * 1000000LL) return false;
+    logged = now;
+    return true;
+  }
 
-    for (auto it = pendingConnects.begin(); it != pendingConnects.end() && !tech_pvt; ++it) {
-      if ((*it)->ws_state == LWS_CLIENT_CONNECTING && (*it)->wsi == wsi) tech_pvt = *it;
+  void dropAudio(private_t* tech_pvt, size_t to, const char* reason) {
+    size_t dropped = to - tech_pvt->audio_cursor;
+    tech_pvt->audio_cursor = to;
+    tech_pvt->drop_pending = 0;
+    fork_stats* stats = statsOf(tech_pvt);
+    bump(stats->bytesDropped, dropped);
+    bump(stats->drops, 1);
+    bump(totals.bytesDropped, dropped);
+    bump(totals.drops, 1);
+    uint64_t total = stats->bytesDropped.load(std::memory_order_relaxed);
+    FORK_TRACE(TRACE_SEND_DROP, tech_pvt->id, dropped, total);
+    if (dropLogDue(tech_pvt->drop_logged)) {
+      switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "(%u) dropping packets! %lu bytes %s, %llu bytes in %llu drops so far\n", 
+        tech_pvt->id, dropped, reason, (unsigned long long) total, (unsigned long long) stats->drops.load(std::memory_order_relaxed));
     }
+  }
 
-    if (tech_pvt) {
-      pendingConnects.remove(tech_pvt);
-      switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "(%u) after removing connection there are now %lu pending connections\n", tech_pvt->id, pendingConnects.size());
+  /* the media thread's counterpart, for audio that didn't fit the capture's ring */
+  void captureDropped(switch_core_session_t *session, private_t* tech_pvt, uint32_t samples, size_t len) {
+    FORK_TRACE(TRACE_CAPTURE_DROP, tech_pvt->id, samples, len);
+    if (dropLogDue(tech_pvt->capture_drop_logged)) {
+      switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR, "(%u) dropping packets! %lu bytes do not fit the audio buffer, %llu drops so far\n", 
+        tech_pvt->id, len, (unsigned long long) statsOf(tech_pvt)->captureDrops.load(std::memory_order_relaxed));
     }
-
-    return tech_pvt;
   }
 
-  void processIncomingMessage(private_t* tech_pvt, int isBinary) {
-    assert(tech_pvt->recv_buf);
-    std::string type;
+  /**
+   * A destination that can't keep up (the far end or the network is slow, so lws stops offering us
+   * writeable callbacks) accumulates a backlog in the ring.  With MOD_AUDIO_FORK_MAX_BACKLOG_MS set,
+   * the backlog is kept to that much audio: by default the oldest audio is dropped so the far end
+   * stays as close to live as it can, while the "newest" policy keeps the backlog intact and drops
+   * whatever is captured beyond it instead, so the far end gets a contiguous stretch with one gap.
+   */
+  void enforceBacklog(private_t* tech_pvt) {
+    if (!nMaxBacklogMs || tech_pvt->drop_pending) return;
+    drachtio::BroadcastRing* ring = static_cast<drachtio::BroadcastRing*>(tech_pvt->capture->audio_ring);
+    const uint64_t limit = (uint64_t) tech_pvt->sampling * nMaxBacklogMs / 1000;
+    const size_t head = ring->head();
+    drachtio::audio_packet_header hdr;
+
+    // samples are counted from the packet headers, so the limit means the same whatever the codec
+    uint64_t total = 0;
+    size_t boundary = 0;
+    bool found = false;
+    for (size_t pos = tech_pvt->audio_cursor; pos != head; pos += sizeof(hdr) + hdr.len) {
+      if (!ring->read(pos, &hdr, sizeof(hdr))) return;  // overrun: readPackets deals with it
+      if (!found && total + hdr.samples > limit) {
+        boundary = pos;
+        found = true;
+      }
+      total += hdr.samples;
+    }
+    if (total <= limit) return;
 
-    if (isBinary) {
-      switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "(%u) processIncomingMessage - unexpected binary message, discarding..\n", tech_pvt->id);
+    if (dropNewest) {
+      tech_pvt->drop_from = boundary;
+      tech_pvt->drop_pending = 1;
       return;
     }
-    std::string msg((char *)tech_pvt->recv_buf, tech_pvt->recv_buf_ptr - tech_pvt->recv_buf);
-    cJSON* json = parse_json(tech_pvt->sessionId, msg, type) ;
-    if (json) {
-      switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "(%u) processIncomingMessage - received %s message\n", tech_pvt->id, type.c_str());
-      cJSON* jsonData = cJSON_GetObjectItem(json, "data");
-      if (0 == type.compare("playAudio")) {
-        if (jsonData) {
-          // dont send actual audio bytes in event message
-          cJSON* jsonFile = NULL;
-          cJSON* jsonAudio = cJSON_DetachItemFromObject(jsonData, "audioContent");
-          int validAudio = (jsonAudio && NULL != jsonAudio->valuestring);
-
-          const char* szAudioContentType = cJSON_GetObjectCstr(jsonData, "audioContentType");
-          char fileType[6];
-          int sampleRate = 16000;
-          if (0 == strcmp(szAudioContentType, "raw")) {
-            cJSON* jsonSR = cJSON_GetObjectItem(jsonData, "sampleRate");
-            sampleRate = jsonSR && jsonSR->valueint ? jsonSR->valueint : 0;
-
-            switch(sampleRate) {
-              case 8000:
-                strcpy(fileType, ".r8");
-                break;
-              case 16000:
-                strcpy(fileType, ".r16");
-                break;
-              case 24000:
-                strcpy(fileType, ".r24");
-                break;
-              case 32000:
-                strcpy(fileType, ".r32");
-                break;
-              case 48000:
-                strcpy(fileType, ".r48");
-                break;
-              case 64000:
-                strcpy(fileType, ".r64");
-                break;
-              default:
-                strcpy(fileType, ".r16");
-                break;
-            }
-          }
-          else if (0 == strcmp(szAudioContentType, ".wave")) {
-            strcpy(fileType, "wave");
-          }
-          else {
-            validAudio = 0;
-            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "(%u) processIncomingMessage - unsupported audioContentType: %s\n", tech_pvt->id, szAudioContentType);
-          }
-
-          if (validAudio) {
-            char szFilePath[256];
-
-            std::string rawAudio = drachtio::base64_decode(jsonAudio->valuestring);
-            switch_snprintf(szFilePath, 256, "%s%s%s_%d.tmp%s", SWITCH_GLOBAL_dirs.temp_dir, 
-              SWITCH_PATH_SEPARATOR, tech_pvt->sessionId, bumpPlayCount(), fileType);
-            std::ofstream f(szFilePath, std::ofstream::binary);
-            f << rawAudio;
-            f.close();
-
-            // add the file to the list of files played for this session, we'll delete when session closes
-            struct playout* playout = (struct playout *) malloc(sizeof(struct playout));
-            playout->file = (char *) malloc(strlen(szFilePath) + 1);
-            strcpy(playout->file, szFilePath);
-            playout->next = tech_pvt->playout;
-            tech_pvt->playout = playout;
-
-            jsonFile = cJSON_CreateString(szFilePath);
-            cJSON_AddItemToObject(jsonData, "file", jsonFile);
-          }
-
-          char* jsonString = cJSON_PrintUnformatted(jsonData);
-          tech_pvt->responseHandler(tech_pvt->sessionId, EVENT_PLAY_AUDIO, jsonString);
-          free(jsonString);
-          if (jsonAudio) cJSON_Delete(jsonAudio);
-        }
-        else {
-          switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "(%u) processIncomingMessage - missing data payload in playAudio request\n", tech_pvt->id); 
-        }
-      }
-      else if (0 == type.compare("killAudio")) {
-        tech_pvt->responseHandler(tech_pvt->sessionId, EVENT_KILL_AUDIO, NULL);
+    uint64_t skipped = 0;
+    size_t pos = tech_pvt->audio_cursor;
+    while (pos != head && total - skipped > limit) {
+      if (!ring->read(pos, &hdr, sizeof(hdr))) return;
+      skipped += hdr.samples;
+      pos += sizeof(hdr) + hdr.len;
+    }
+    dropAudio(tech_pvt, pos, "of backlog over the limit");
+  }
 
-        // kill any current playback on the channel
-        switch_core_session_t* session = switch_core_session_locate(tech_pvt->sessionId);
-        if (session) {
-          switch_channel_t *channel = switch_core_session_get_channel(session);
-          switch_channel_set_flag_value(channel, CF_BREAK, 2);
-          switch_core_session_rwunlock(session);
-        }
+  /* what a frame header says about the packets batched into one message */
+  struct frame_info {
+    uint32_t seq;
+    uint32_t packets;
+    uint32_t samples;
+    int64_t captured;
+  };
 
+  /**
+   * Move whole packets from the capture's ring into this destination's send buffer.  Packets that
+   * the far end can simply concatenate (L16, FLAC) are batched up to the buffer size; codecs that
+   * rely on websocket message boundaries (opus) get one packet per message.  If this destination
+   * has fallen so far behind that the capture has overwritten what it had not sent yet, it skips
+   * ahead to the newest packet.  A framed message never spans such a gap, so the far end can
+   * see exactly where audio is missing from the sequence numbers.  With a frame size set, a message
+   * holds whole packets up to the first that brings it to frame_samples, so with the usual 20ms
+   * packets and a frame size that is a multiple of 20ms every message is the same size.
+   */
+  size_t readPackets(private_t* tech_pvt, uint8_t* out, size_t maxLen, frame_info& info) {
+    private_t* capture = tech_pvt->capture;
+    drachtio::BroadcastRing* ring = static_cast<drachtio::BroadcastRing*>(capture->audio_ring);
+    drachtio::audio_packet_header hdr;
+    size_t datalen = 0;
+    memset(&info, 0, sizeof(info));
+
+    size_t backlog = ring->head() - tech_pvt->audio_cursor;
+    highWater(statsOf(tech_pvt)->backlogHighWater, backlog);
+    highWater(totals.backlogHighWater, backlog);
+
+    enforceBacklog(tech_pvt);
+    while (ring->head() != tech_pvt->audio_cursor) {
+      size_t pos = tech_pvt->audio_cursor;
+      if (dropNewest && tech_pvt->drop_pending && tech_pvt->drop_from == pos) {
+        // the backlog kept under the "newest" policy has been sent; what was captured meanwhile goes
+        dropAudio(tech_pvt, ring->head(), "captured while the backlog was full");
+        break;
       }
-      else if (0 == type.compare("transcription")) {
-        char* jsonString = cJSON_PrintUnformatted(jsonData);
-        tech_pvt->responseHandler(tech_pvt->sessionId, EVENT_TRANSCRIPTION, jsonString);
-        free(jsonString);        
-      }
-      else if (0 == type.compare("transfer")) {
-        char* jsonString = cJSON_PrintUnformatted(jsonData);
-        tech_pvt->responseHandler(tech_pvt->sessionId, EVENT_TRANSFER, jsonString);
-        free(jsonString);                
+      if (!ring->read(pos, &hdr, sizeof(hdr)) || 
+        (datalen + hdr.len <= maxLen && !ring->read(pos + sizeof(hdr), out + datalen, hdr.len))) {
+        dropAudio(tech_pvt, ring->lastPacket(), "overwritten by the capture before they could be sent");
+        continue;
       }
-      else if (0 == type.compare("disconnect")) {
-        char* jsonString = cJSON_PrintUnformatted(jsonData);
-        tech_pvt->responseHandler(tech_pvt->sessionId, EVENT_DISCONNECT, jsonString);
-        free(jsonString);        
+      if (datalen + hdr.len > maxLen) break;
+      if (info.packets == 0) {
+        info.seq = hdr.seq;
+        info.captured = hdr.captured;
       }
-      else if (0 == type.compare("error")) {
-        char* jsonString = cJSON_PrintUnformatted(jsonData);
-        tech_pvt->responseHandler(tech_pvt->sessionId, EVENT_ERROR, jsonString);
-        free(jsonString);        
-      }
-      else {
-        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "(%u) processIncomingMessage - unsupported msg type %s\n", tech_pvt->id, type.c_str());  
-      }
-      cJSON_Delete(json);
+      else if (tech_pvt->framing && hdr.seq != info.seq + info.packets) break;
+      tech_pvt->audio_cursor = pos + sizeof(hdr) + hdr.len;
+      datalen += hdr.len;
+      info.packets++;
+      info.samples += hdr.samples;
+      if (capture->message_per_packet) break;
+      if (tech_pvt->frame_samples && info.samples >= tech_pvt->frame_samples) break;
     }
+    return datalen;
+  }
 
-    delete [] tech_pvt->recv_buf;
-    tech_pvt->recv_buf = NULL;
-    tech_pvt->recv_buf_ptr = NULL;
+  /**
+   * The opt-in frame header, all fields big-endian:
+   *   version (1 byte), channels (1), packets (2), sequence number of the first packet (4),
+   *   capture time of the first packet in microseconds since the epoch (8), samples per channel (4)
+   * A frame with no packets carries the codec's stream header, resent after a reconnect.
+   */
+  void writeFrameHeader(private_t* tech_pvt, uint8_t* out, const frame_info& info) {
+    uint64_t captured = (uint64_t) info.captured;
+    out[0] = FRAME_HEADER_VERSION;
+    out[1] = (uint8_t) tech_pvt->channels;
+    out[2] = info.packets >> 8;
+    out[3] = info.packets;
+    for (int i = 0; i < 4; i++) out[4 + i] = info.seq >> (24 - 8 * i);
+    for (int i = 0; i < 8; i++) out[8 + i] = captured >> (56 - 8 * i);
+    for (int i = 0; i < 4; i++) out[16 + i] = info.samples >> (24 - 8 * i);
   }
 
-  int connect_client(private_t* tech_pvt, struct lws_per_vhost_data *vhd) {
-    struct lws_client_connect_info i;
+  /* the next binary message for a destination: the stream header if it is owed one, else whatever audio is waiting;
+     returns the length of the message and sets audioLen to the part of it that is audio */
+  size_t readFrame(private_t* tech_pvt, uint8_t* out, size_t maxLen, size_t& audioLen, bool partial = false) {
+    const size_t hdrLen = tech_pvt->framing ? FRAME_HEADER_LEN : 0;
+    frame_info info = {};
+    audioLen = 0;
+    if (maxLen <= hdrLen) return 0;
+    if (!tech_pvt->resend_header && !hasAudio(tech_pvt, partial)) return 0;
+    if (tech_pvt->resend_header) audioLen = readStreamHeader(tech_pvt, out + hdrLen, maxLen - hdrLen);
+    if (0 == audioLen) audioLen = readPackets(tech_pvt, out + hdrLen, maxLen - hdrLen, info);
+    if (0 == audioLen) return 0;
+    if (hdrLen) writeFrameHeader(tech_pvt, out, info);
+    return hdrLen + audioLen;
+  }
 
-    memset(&i, 0, sizeof(i));
+	uint32_t bumpPlayCount(void) { return ++playCount; }
 
-    i.context = vhd->context;
-    i.port = tech_pvt->port;
-    i.address = tech_pvt->host;
-    i.path = tech_pvt->path;
-    i.host = i.address;
-    i.origin = i.address;
-    i.ssl_connection = tech_pvt->sslFlags;
-    i.protocol = mySubProtocolName;
-    i.pwsi = &(tech_pvt->wsi);
+  /* a playAudio request whose audio still has to be decoded and written to a temp file */
+  struct playout_job {
+    private_t* tech_pvt;
+    cJSON* jsonData;    // the data attribute of the request, which becomes the event body
+    cJSON* jsonAudio;   // the base64 audioContent, or NULL if there is nothing valid to write
+    std::string fileType;
+  };
 
-    tech_pvt->ws_state = LWS_CLIENT_CONNECTING;
-    tech_pvt->vhd = vhd;
+  /* each session always uses the same worker, so its play_audio events are fired in the order they arrived */
+  struct playout_worker {
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::deque<playout_job> jobs;
+    bool stopping = false;
+  };
+  static std::vector<std::unique_ptr<playout_worker>> playoutWorkers;
+
+  void writePlayout(playout_job& job) {
+    private_t* tech_pvt = job.tech_pvt;
+
+    if (job.jsonAudio) {
+      char szFilePath[256];
+
+      size_t encodedLen = strlen(job.jsonAudio->valuestring);
+      std::unique_ptr<unsigned char[]> rawAudio(new unsigned char[drachtio::base64_decoded_size(encodedLen)]);
+      size_t rawAudioLen = drachtio::base64_decode(job.jsonAudio->valuestring, encodedLen, rawAudio.get());
+      switch_snprintf(szFilePath, 256, "%s%s%s_%d.tmp%s", SWITCH_GLOBAL_dirs.temp_dir, 
+        SWITCH_PATH_SEPARATOR, tech_pvt->sessionId, bumpPlayCount(), job.fileType.c_str());
+      std::ofstream f(szFilePath, std::ofstream::binary);
+      f.write(reinterpret_cast<const char*>(rawAudio.get()), rawAudioLen);
+      f.close();
+
+      // add the file to the list of files played for this session, we'll delete when session closes
+      struct playout* playout = (struct playout *) malloc(sizeof(struct playout));
+      playout->file = (char *) malloc(strlen(szFilePath) + 1);
+      strcpy(playout->file, szFilePath);
+      switch_mutex_lock(tech_pvt->mutex);
+      playout->next = tech_pvt->playout;
+      tech_pvt->playout = playout;
+      switch_mutex_unlock(tech_pvt->mutex);
 
-    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "(%u) calling lws_client_connect_via_info\n", tech_pvt->id);
+      cJSON_AddItemToObject(job.jsonData, "file", cJSON_CreateString(szFilePath));
+      cJSON_Delete(job.jsonAudio);
+    }
 
-    if (!lws_client_connect_via_info(&i)) {
-      //tech_pvt->ws_state = LWS_CLIENT_IDLE;
-      return 0;
+    char* jsonString = cJSON_PrintUnformatted(job.jsonData);
+    tech_pvt->responseHandler(tech_pvt->sessionId, EVENT_PLAY_AUDIO, jsonString);
+    free(jsonString);
+    cJSON_Delete(job.jsonData);
+
+    // fork_session_cleanup waits for this before deleting the files and tearing down the session
+    switch_mutex_lock(tech_pvt->mutex);
+    tech_pvt->pending_playouts--;
+    switch_thread_cond_signal(tech_pvt->cond);
+    switch_mutex_unlock(tech_pvt->mutex);
+  }
+
+  void playout_thread(playout_worker* worker) {
+    std::unique_lock<std::mutex> lk(worker->mutex);
+    for (;;) {
+      worker->cond.wait(lk, [worker] { return worker->stopping || !worker->jobs.empty(); });
+      if (worker->jobs.empty()) return;
+      playout_job job = worker->jobs.front();
+      worker->jobs.pop_front();
+      lk.unlock();
+      writePlayout(job);
+      lk.lock();
+    }
+  }
+
+  void addPlayoutJob(const playout_job& job) {
+    private_t* tech_pvt = job.tech_pvt;
+    switch_mutex_lock(tech_pvt->mutex);
+    tech_pvt->pending_playouts++;
+    switch_mutex_unlock(tech_pvt->mutex);
+
+    // with no worker to take it (none started, or they have stopped for the unload) the job is done here
+    playout_worker* worker = playoutWorkers.empty() ? nullptr : playoutWorkers[tech_pvt->id % playoutWorkers.size()].get();
+    bool queued = false;
+    if (worker) {
+      std::lock_guard<std::mutex> lk(worker->mutex);
+      if (!worker->stopping) {
+        worker->jobs.push_back(job);
+        queued = true;
+      }
+    }
+    if (queued) {
+      worker->cond.notify_one();
+      return;
     }
+    playout_job inline_job(job);
+    writePlayout(inline_job);
+  }
+
+  void addWork(private_t* tech_pvt, int type) {
+    service_ctx& ctx = services[tech_pvt->service_thread];
+    work_item item = { type, tech_pvt };
+    ctx.work.push(item);
+    struct lws_context* context = ctx.context.load();
+    if (context) lws_cancel_service(context);
+  }
+
+  void addPendingConnect(private_t* tech_pvt) {
+    tech_pvt->ws_state = LWS_CLIENT_IDLE;
+    addWork(tech_pvt, WORK_CONNECT);
+    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "(%u) queued connect on service thread %u\n", tech_pvt->id, tech_pvt->service_thread);
+  }
+
+  void addPendingDisconnect(private_t* tech_pvt) {
+    tech_pvt->ws_state = LWS_CLIENT_DISCONNECTING;
+    addWork(tech_pvt, WORK_DISCONNECT);
+    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "(%u) queued disconnect on service thread %u\n", tech_pvt->id, tech_pvt->service_thread);
+  }
+
+  void addPendingWrite(private_t* tech_pvt) {
+    addWork(tech_pvt, WORK_WRITE);
+  }
+
+  // frames are stored with LWS_PRE bytes of headroom so they can be handed straight to lws_write
+  void queueFrame(private_t* tech_pvt, const char* text) {
+    std::string frame(LWS_PRE, '\0');
+    frame.append(text);
+    static_cast<text_fifo*>(tech_pvt->text_fifo)->queued.push(frame);
+  }
+
+  /* control message for one stream of a multiplexed connection; the stream's own text travels as a string */
+  std::string muxMessage(private_t* tech_pvt, const char* type, const char* key, const char* value) {
+    cJSON* json = cJSON_CreateObject();
+    cJSON_AddItemToObject(json, "type", cJSON_CreateString(type));
+    cJSON_AddItemToObject(json, "streamId", cJSON_CreateNumber(tech_pvt->id));
+    if (0 == strcmp(type, "start")) cJSON_AddItemToObject(json, "callId", cJSON_CreateString(tech_pvt->sessionId));
+    if (key && value) cJSON_AddItemToObject(json, key, cJSON_CreateString(value));
+    char* text = cJSON_PrintUnformatted(json);
+    std::string message(text);
+    free(text);
+    cJSON_Delete(json);
+    return message;
+  }
+
+  void queueText(private_t* tech_pvt, const char* text) {
+    if (tech_pvt->multiplexed) queueFrame(tech_pvt, muxMessage(tech_pvt, "text", "data", text).c_str());
+    else queueFrame(tech_pvt, text);
+  }
 
+  /**
+   * Send the oldest queued text frame, if any.  Returns 1 if one was sent, 0 if there was nothing
+   * to send and -1 if the write failed.
+   */
+  int writeText(private_t* tech_pvt, struct lws *wsi) {
+    text_fifo* texts = static_cast<text_fifo*>(tech_pvt->text_fifo);
+    texts->queued.popAll(texts->batch);
+    for (auto& frame : texts->batch) texts->pending.push_back(std::move(frame));
+    texts->batch.clear();
+    if (texts->pending.empty()) return 0;
+
+    std::string& frame = texts->pending.front();
+    int n = frame.size() - LWS_PRE;
+    int m = lws_write(wsi, (unsigned char *) &frame[LWS_PRE], n, LWS_WRITE_TEXT);
+    texts->pending.pop_front();
+    if (m < n) {
+      switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "(%u) error writing text %d requested, %d written\n", tech_pvt->id, n, m);
+      return -1;
+    }
+    FORK_TRACE(TRACE_TEXT_SENT, tech_pvt->id, n, 0);
     return 1;
   }
 
-  static int lws_callback(struct lws *wsi, 
-    enum lws_callback_reasons reason,
-    void *user, void *in, size_t len) {
+  bool hasText(private_t* tech_pvt) {
+    text_fifo* texts = static_cast<text_fifo*>(tech_pvt->text_fifo);
+    return !texts->pending.empty() || !texts->queued.empty();
+  }
 
-    struct lws_per_vhost_data *vhd = 
-      (struct lws_per_vhost_data *) lws_protocol_vh_priv_get(lws_get_vhost(wsi), lws_get_protocol(wsi));
+  /**
+   * Called on the service thread, with the mutex held, when a connection that was up has gone away or
+   * an attempt to bring it back has failed.  Rather than giving up on the call, try again after an
+   * exponential backoff; meanwhile the capture carries on, and this destination's cursor into the
+   * ring holds its place, so the audio is replayed once connected (as much of it as the ring holds).
+   */
+  bool scheduleReconnect(private_t* tech_pvt) {
+    if (tech_pvt->reconnects >= tech_pvt->max_reconnects) return false;
+
+    int delay = nReconnectBackoffMs;
+    for (int i = 0; i < tech_pvt->reconnects && delay < nReconnectMaxBackoffMs; i++) delay *= 2;
+    delay = std::min(delay, nReconnectMaxBackoffMs);
+    tech_pvt->reconnects++;
+    tech_pvt->reconnecting = 1;
+    bump(statsOf(tech_pvt)->reconnects, 1);
+    bump(totals.reconnects, 1);
+    tech_pvt->ws_state = LWS_CLIENT_IDLE;
+    tech_pvt->wsi = nullptr;
+    if (tech_pvt->endpoint) tech_pvt->endpoints_tried = 1u << static_cast<group_endpoint*>(tech_pvt->endpoint)->index;
 
-    struct lws_vhost* vhost = lws_get_vhost(wsi);
-  	private_t ** pCb = (private_t **) user;
+    // the initial metadata (and the codec's stream header, if the far end had it) go out again first
+    text_fifo* texts = static_cast<text_fifo*>(tech_pvt->text_fifo);
+    if (!texts->initial.empty() && (texts->pending.empty() || texts->pending.front() != texts->initial)) {
+      texts->pending.push_front(texts->initial);
+    }
+    tech_pvt->text_turn = 1;
+    if (tech_pvt->audio_cursor != 0 && tech_pvt->capture->stream_header_len) tech_pvt->resend_header = 1;
 
-    switch (reason) {
+    services[tech_pvt->service_thread].reconnects.push_back(std::make_pair(switch_micro_time_now() + delay * 1000, tech_pvt));
+    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "(%u) reconnecting to %s in %d ms (attempt %d of %d)\n", 
+      tech_pvt->id, tech_pvt->host, delay, tech_pvt->reconnects, tech_pvt->max_reconnects);
+    return true;
+  }
 
-    case LWS_CALLBACK_PROTOCOL_INIT:
-      switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "lws_callback LWS_CALLBACK_PROTOCOL_INIT wsi: %p\n", wsi);
-      vhd = (struct lws_per_vhost_data *) lws_protocol_vh_priv_zalloc(lws_get_vhost(wsi), lws_get_protocol(wsi), sizeof(struct lws_per_vhost_data));
-      vhd->context = lws_get_context(wsi);
-      vhd->protocol = lws_get_protocol(wsi);
-      vhd->vhost = lws_get_vhost(wsi);
-      break;
+  /* stopped while waiting to reconnect: nothing to close, just stop waiting */
+  /* returns false if no reconnect was pending */
+  bool cancelReconnect(service_ctx* ctx, private_t* tech_pvt) {
+    for (auto it = ctx->reconnects.begin(); it != ctx->reconnects.end(); ++it) {
+      if (it->second != tech_pvt) continue;
+      ctx->reconnects.erase(it);
+      switch_mutex_lock(tech_pvt->mutex);
+      if (tech_pvt->ws_state == LWS_CLIENT_DISCONNECTING) tech_pvt->ws_state = LWS_CLIENT_DISCONNECTED;
+      switch_thread_cond_signal(tech_pvt->cond);
+      switch_mutex_unlock(tech_pvt->mutex);
+      return true;
+    }
+    return false;
+  }
 
-    case LWS_CALLBACK_EVENT_WAIT_CANCELLED:
-      {        
-        // check if we have any new connections requested
-        {
-          std::lock_guard<std::mutex> guard(g_mutex_connects);
-          for (auto it = pendingConnects.begin(); it != pendingConnects.end(); ++it) {
-            private_t* tech_pvt = *it;
-            if (tech_pvt->ws_state == LWS_CLIENT_IDLE) {
-              connect_client(tech_pvt, vhd);
-            }
-          }
-        }
+  void runReconnects(service_ctx* ctx);
+  void topUpPools(service_ctx* ctx);
+  void runHealthChecks(service_ctx* ctx);
+
+  /**
+   * Audio is never sent from the media thread's point of view: fork_frame() only fills the ring, and
+   * every flush interval the service thread asks for a writable callback on each connection that has
+   * something buffered.  A non-empty ring is the dirty mark, so thousands of calls cost one wakeup
+   * per context per interval rather than one per call per frame.
+   */
+  void flushConnections(service_ctx* ctx) {
+    runReconnects(ctx);
+    topUpPools(ctx);
+    runHealthChecks(ctx);
+
+    size_t shared = 0;
+    for (auto it = ctx->muxes.begin(); it != ctx->muxes.end(); ++it) shared += it->second.size();
+    ctx->nConnections.store(ctx->connections.size(), std::memory_order_relaxed);
+    ctx->nShared.store(shared, std::memory_order_relaxed);
+    ctx->nReconnecting.store(ctx->reconnects.size(), std::memory_order_relaxed);
+    size_t warm = 0;
+    for (auto it = ctx->pools.begin(); it != ctx->pools.end(); ++it) warm += it->idle.size();
+    ctx->nWarm.store(warm, std::memory_order_relaxed);
+
+    for (auto it = ctx->connections.begin(); it != ctx->connections.end(); ++it) {
+      private_t* tech_pvt = *it;
+      if (tech_pvt->ws_state == LWS_CLIENT_CONNECTED && hasAudio(tech_pvt)) lws_callback_on_writable(tech_pvt->wsi);
+    }
+    ctx->nextFlush = switch_micro_time_now() + nFlushIntervalMs * 1000;
+  }
 
-        // process writes
-        {
-          std::lock_guard<std::mutex> guard(g_mutex_writes);
-          for (auto it = pendingWrites.begin(); it != pendingWrites.end(); ++it) {
-            private_t* tech_pvt = *it;
-            if (tech_pvt && tech_pvt->ws_state == LWS_CLIENT_CONNECTED) lws_callback_on_writable(tech_pvt->wsi);
-          }
-          pendingWrites.clear();
-        }
+#if LWS_LIBRARY_VERSION_MAJOR >= 4
+  void flush_timer_cb(lws_sorted_usec_list_t *sul) {
+    flush_timer* timer = lws_container_of(sul, flush_timer, sul);
+    flushConnections(timer->ctx);
+    lws_sul_schedule(timer->ctx->context, 0, &timer->sul, flush_timer_cb, nFlushIntervalMs * 1000);
+  }
+#endif
+
+  void processIncomingAudio(private_t* tech_pvt, const uint8_t* data, size_t len) {
+    drachtio::PlaybackBuffer* playback = static_cast<drachtio::PlaybackBuffer*>(tech_pvt->playback);
+    if (!playback) {
+      switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "(%u) processIncomingMessage - unexpected binary message, discarding..\n", tech_pvt->id);
+    }
+    else if (!playback->write(data, len)) {
+      switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "(%u) processIncomingMessage - playback buffer full, dropping audio\n", tech_pvt->id);
+    }
+  }
 
-        // process disconnects
-        {
-          std::lock_guard<std::mutex> guard(g_mutex_disconnects);
-          for (auto it = pendingDisconnects.begin(); it != pendingDisconnects.end(); ++it) {
-            private_t* tech_pvt = *it;
-            if (tech_pvt && tech_pvt->ws_state == LWS_CLIENT_DISCONNECTING) lws_callback_on_writable(tech_pvt->wsi);
+  void processJsonMessage(private_t* tech_pvt, cJSON* json, const std::string& type) {
+    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "(%u) processIncomingMessage - received %s message\n", tech_pvt->id, type.c_str());
+    cJSON* jsonData = cJSON_GetObjectItem(json, "data");
+    if (0 == type.compare("playAudio")) {
+      if (jsonData) {
+        // dont send actual audio bytes in event message
+        cJSON* jsonAudio = cJSON_DetachItemFromObject(jsonData, "audioContent");
+        int validAudio = (jsonAudio && NULL != jsonAudio->valuestring);
+
+        const char* szAudioContentType = cJSON_GetObjectCstr(jsonData, "audioContentType");
+        char fileType[6];
+        int sampleRate = 16000;
+        if (0 == strcmp(szAudioContentType, "raw")) {
+          cJSON* jsonSR = cJSON_GetObjectItem(jsonData, "sampleRate");
+          sampleRate = jsonSR && jsonSR->valueint ? jsonSR->valueint : 0;
+
+          switch(sampleRate) {
+            case 8000:
+              strcpy(fileType, ".r8");
+              break;
+            case 16000:
+              strcpy(fileType, ".r16");
+              break;
+            case 24000:
+              strcpy(fileType, ".r24");
+              break;
+            case 32000:
+              strcpy(fileType, ".r32");
+              break;
+            case 48000:
+              strcpy(fileType, ".r48");
+              break;
+            case 64000:
+              strcpy(fileType, ".r64");
+              break;
+            default:
+              strcpy(fileType, ".r16");
+              break;
           }
-          pendingDisconnects.clear();
         }
-      }
-      break;
-
-    /* --- client callbacks --- */
-    case LWS_CALLBACK_CLIENT_CONNECTION_ERROR:
-      switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "lws_callback LWS_CALLBACK_CLIENT_CONNECTION_ERROR wsi: %p\n", wsi);
-      {
-        private_t* tech_pvt = findAndRemovePendingConnect(wsi);
-        if (!tech_pvt) {
-          switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "LWS_CALLBACK_CLIENT_CONNECTION_ERROR unable to find pending connection for wsi: %p\n", wsi);
+        else if (0 == strcmp(szAudioContentType, ".wave")) {
+          strcpy(fileType, "wave");
         }
         else {
-          switch_mutex_lock(tech_pvt->mutex);
-          tech_pvt->ws_state = LWS_CLIENT_FAILED;
-          switch_thread_cond_signal(tech_pvt->cond);
-          switch_mutex_unlock(tech_pvt->mutex);
+          validAudio = 0;
+          switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "(%u) processIncomingMessage - unsupported audioContentType: %s\n", tech_pvt->id, szAudioContentType);
         }
-      }      
-      break;
 
-
-    case LWS_CALLBACK_CLIENT_ESTABLISHED:
-
-      // remove the associated cb from the pending list and allocate audio ring buffer
-      {
-        private_t* tech_pvt = findAndRemovePendingConnect(wsi);
-        if (!tech_pvt) {
-          switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "lws_callback LWS_CALLBACK_CLIENT_ESTABLISHED unable to find pending connection for wsi: %p\n", wsi);
+        if (!validAudio && jsonAudio) {
+          cJSON_Delete(jsonAudio);
+          jsonAudio = NULL;
         }
-        else {
-          *pCb = tech_pvt;
-          switch_mutex_lock(tech_pvt->mutex);
-          tech_pvt->vhd = vhd;
-          tech_pvt->ws_state = LWS_CLIENT_CONNECTED;
-          switch_thread_cond_signal(tech_pvt->cond);
-          switch_mutex_unlock(tech_pvt->mutex);
+
+        // decoding and writing the file is left to a playout worker so this thread can get back to sending audio
+        playout_job job;
+        job.tech_pvt = tech_pvt;
+        job.jsonData = cJSON_DetachItemFromObject(json, "data");
+        job.jsonAudio = jsonAudio;
+        job.fileType = validAudio ? fileType : "";
+        addPlayoutJob(job);
+      }
+      else {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "(%u) processIncomingMessage - missing data payload in playAudio request\n", tech_pvt->id); 
+      }
+    }
+    else if (0 == type.compare("killAudio")) {
+      tech_pvt->responseHandler(tech_pvt->sessionId, EVENT_KILL_AUDIO, NULL);
+
+      // drop any streamed audio that has not been played out yet
+      if (tech_pvt->playback) static_cast<drachtio::PlaybackBuffer*>(tech_pvt->playback)->flush();
+
+      // kill any current playback on the channel
+      switch_core_session_t* session = switch_core_session_locate(tech_pvt->sessionId);
+      if (session) {
+        switch_channel_t *channel = switch_core_session_get_channel(session);
+        switch_channel_set_flag_value(channel, CF_BREAK, 2);
+        switch_core_session_rwunlock(session);
+      }
+
+    }
+    else if (0 == type.compare("transcription")) {
+      char* jsonString = cJSON_PrintUnformatted(jsonData);
+      tech_pvt->responseHandler(tech_pvt->sessionId, EVENT_TRANSCRIPTION, jsonString);
+      free(jsonString);        
+    }
+    else if (0 == type.compare("transfer")) {
+      char* jsonString = cJSON_PrintUnformatted(jsonData);
+      tech_pvt->responseHandler(tech_pvt->sessionId, EVENT_TRANSFER, jsonString);
+      free(jsonString);                
+    }
+    else if (0 == type.compare("disconnect")) {
+      char* jsonString = cJSON_PrintUnformatted(jsonData);
+      tech_pvt->responseHandler(tech_pvt->sessionId, EVENT_DISCONNECT, jsonString);
+      free(jsonString);        
+    }
+    else if (0 == type.compare("error")) {
+      char* jsonString = cJSON_PrintUnformatted(jsonData);
+      tech_pvt->responseHandler(tech_pvt->sessionId, EVENT_ERROR, jsonString);
+      free(jsonString);        
+    }
+    else {
+      switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "(%u) processIncomingMessage - unsupported msg type %s\n", tech_pvt->id, type.c_str());  
+    }
+  }
+
+  void processIncomingMessage(private_t* tech_pvt, int isBinary) {
+    assert(tech_pvt->recv_buf);
+    std::string type;
+
+    if (isBinary) {
+      processIncomingAudio(tech_pvt, tech_pvt->recv_buf, tech_pvt->recv_buf_ptr - tech_pvt->recv_buf);
+    }
+    else {
+      // parsed in place; appendRecvBuffer always leaves room for the terminator
+      *tech_pvt->recv_buf_ptr = '\0';
+      cJSON* json = parse_json(tech_pvt->sessionId, (const char *) tech_pvt->recv_buf, type) ;
+      if (json) {
+        processJsonMessage(tech_pvt, json, type);
+        cJSON_Delete(json);
+      }
+    }
+
+    // keep the buffer for the next message unless this one was unusually large
+    if (tech_pvt->recv_buf_len > RECV_BUF_RETAIN_SIZE) {
+      delete [] tech_pvt->recv_buf;
+      tech_pvt->recv_buf = NULL;
+      tech_pvt->recv_buf_len = 0;
+    }
+    tech_pvt->recv_buf_ptr = tech_pvt->recv_buf;
+  }
+
+  /* make sure the receive buffer can hold needed bytes of message plus a terminator, keeping what is already there */
+  void reserveRecvBuffer(private_t* tech_pvt, size_t needed) {
+    size_t used = tech_pvt->recv_buf_ptr - tech_pvt->recv_buf;
+    if (used + needed + 1 <= tech_pvt->recv_buf_len) return;
+
+    size_t newLen = std::max(tech_pvt->recv_buf_len * 2, (size_t) RECV_BUF_INITIAL_SIZE);
+    while (newLen < used + needed + 1) newLen *= 2;
+    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "(%u) growing receive buffer to %lu bytes\n", tech_pvt->id, newLen);
+
+    uint8_t* buf = new uint8_t[newLen];
+    if (used) memcpy(buf, tech_pvt->recv_buf, used);
+    delete [] tech_pvt->recv_buf;
+    tech_pvt->recv_buf = buf;
+    tech_pvt->recv_buf_ptr = buf + used;
+    tech_pvt->recv_buf_len = newLen;
+  }
+
+  void appendRecvBuffer(private_t* tech_pvt, const uint8_t* data, size_t len) {
+    reserveRecvBuffer(tech_pvt, len);
+    if (len > 0) {
+      memcpy(tech_pvt->recv_buf_ptr, data, len);
+      tech_pvt->recv_buf_ptr += len;
+    }
+  }
+
+  /* the address lws should connect to: a cached one if we have it, else the host name for lws to resolve */
+  const char* connectAddress(const char* host, std::string& resolved) {
+    return dnsCache.lookup(host, resolved) ? resolved.c_str() : host;
+  }
+
+  /* try another endpoint of the call's group right away; called on the call's service thread with its lock held */
+  bool failover(private_t* tech_pvt) {
+    destination_group* group = groupOf(tech_pvt);
+    if (!group) return false;
+    group_endpoint* ep = selectEndpoint(group, tech_pvt->sessionId, tech_pvt->endpoints_tried);
+    if (!ep) return false;
+
+    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "(%u) failing over from %s to %s in group %s\n", 
+      tech_pvt->id, static_cast<group_endpoint*>(tech_pvt->endpoint)->url.c_str(), ep->url.c_str(), group->name.c_str());
+    assignEndpoint(tech_pvt, ep);
+    tech_pvt->ws_state = LWS_CLIENT_IDLE;
+    tech_pvt->wsi = nullptr;
+    services[tech_pvt->service_thread].reconnects.push_back(std::make_pair(switch_micro_time_now(), tech_pvt));
+    return true;
+  }
+
+  void connectFailed(private_t* tech_pvt) {
+    bool notify = false;
+
+    // the cached address may be stale, so the next attempt resolves the name again
+    dnsCache.forget(tech_pvt->host);
+    if (tech_pvt->endpoint) endpointFailed(static_cast<group_endpoint*>(tech_pvt->endpoint));
+
+    switch_mutex_lock(tech_pvt->mutex);
+    if (tech_pvt->ws_state == LWS_CLIENT_DISCONNECTING) {
+      // stopped while we were still connecting; nobody is interested in the outcome
+      tech_pvt->ws_state = LWS_CLIENT_DISCONNECTED;
+    }
+    else if (tech_pvt->ws_state == LWS_CLIENT_CONNECTING && !failover(tech_pvt) && 
+      !(tech_pvt->reconnecting && scheduleReconnect(tech_pvt))) {
+      tech_pvt->ws_state = LWS_CLIENT_FAILED;
+      notify = true;
+    }
+    switch_thread_cond_signal(tech_pvt->cond);
+    switch_mutex_unlock(tech_pvt->mutex);
+
+    if (notify) tech_pvt->responseHandler(tech_pvt->sessionId, EVENT_CONNECT_FAIL, NULL);
+  }
+
+  std::string connectionKey(const char* host, unsigned int port, const char* path, int sslFlags) {
+    char key[MAX_WS_URL_LEN + MAX_PATH_LEN + 16];
+    snprintf(key, sizeof(key), "%s:%u%s%s", host, port, path, sslFlags ? ";tls" : "");
+    return key;
+  }
+
+  /* send the initial metadata and any audio buffered while connecting, or close
+     right away if we were stopped while the handshake was in progress */
+  void connectionEstablished(service_ctx* ctx, private_t* tech_pvt, struct lws* wsi, struct lws_per_vhost_data* vhd) {
+    bool notify = false;
+    switch_mutex_lock(tech_pvt->mutex);
+    tech_pvt->vhd = vhd;
+    if (tech_pvt->ws_state != LWS_CLIENT_DISCONNECTING) {
+      tech_pvt->ws_state = LWS_CLIENT_CONNECTED;
+      tech_pvt->reconnects = 0;
+      tech_pvt->reconnecting = 0;
+      notify = true;
+    }
+    switch_thread_cond_signal(tech_pvt->cond);
+    switch_mutex_unlock(tech_pvt->mutex);
+
+    groupConnected(tech_pvt);
+    ctx->connections.insert(tech_pvt);
+    lws_callback_on_writable(wsi);
+    if (notify) tech_pvt->responseHandler(tech_pvt->sessionId, EVENT_CONNECT_SUCCESS, NULL);
+  }
+
+  /* a connection is only ever handed from the pool to a session on the pool's own service thread */
+  bool claimPooled(service_ctx* ctx, private_t* tech_pvt, struct lws_per_vhost_data *vhd) {
+    if (ctx->pools.empty()) return false;
+    std::string key = connectionKey(tech_pvt->host, tech_pvt->port, tech_pvt->path, tech_pvt->sslFlags);
+    for (auto it = ctx->pools.begin(); it != ctx->pools.end(); ++it) {
+      if (it->key != key || it->idle.empty()) continue;
+      struct lws* wsi = it->idle.front();
+      it->idle.pop_front();
+
+      // from here on lws hands the session back as 'user', exactly as if it had connected itself
+      lws_set_wsi_user(wsi, tech_pvt);
+      tech_pvt->wsi = wsi;
+      switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "(%u) using prewarmed connection to %s, %lu left\n", 
+        tech_pvt->id, key.c_str(), it->idle.size());
+      connectionEstablished(ctx, tech_pvt, wsi, vhd);
+      return true;
+    }
+    return false;
+  }
+
+  int connect_client(private_t* tech_pvt, struct lws_per_vhost_data *vhd) {
+    struct lws_client_connect_info i;
+
+    memset(&i, 0, sizeof(i));
+
+    i.context = vhd->context;
+    i.port = tech_pvt->port;
+    std::string resolved;
+    i.address = connectAddress(tech_pvt->host, resolved);
+    i.path = tech_pvt->path;
+    i.host = tech_pvt->host;    // also the name TLS verifies the certificate against
+    i.origin = tech_pvt->host;
+    i.ssl_connection = tech_pvt->sslFlags;
+    i.protocol = mySubProtocolName;
+    i.pwsi = &(tech_pvt->wsi);
+    i.userdata = tech_pvt;  // lws hands this back as 'user' in every callback for this wsi
+
+    // the session may have been stopped before we got to it
+    switch_mutex_lock(tech_pvt->mutex);
+    if (tech_pvt->ws_state != LWS_CLIENT_IDLE) {
+      tech_pvt->ws_state = LWS_CLIENT_DISCONNECTED;
+      switch_thread_cond_signal(tech_pvt->cond);
+      switch_mutex_unlock(tech_pvt->mutex);
+      return 0;
+    }
+    tech_pvt->ws_state = LWS_CLIENT_CONNECTING;
+    tech_pvt->vhd = vhd;
+    switch_mutex_unlock(tech_pvt->mutex);
+
+    if (claimPooled((service_ctx *) lws_context_user(vhd->context), tech_pvt, vhd)) return 1;
+
+    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "(%u) calling lws_client_connect_via_info\n", tech_pvt->id);
+
+    if (!lws_client_connect_via_info(&i)) {
+      // a no-op if lws already reported LWS_CALLBACK_CLIENT_CONNECTION_ERROR
+      switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "(%u) lws_client_connect_via_info failed\n", tech_pvt->id);
+      connectFailed(tech_pvt);
+      return 0;
+    }
+
+    return 1;
+  }
+
+  /**
+   * Multiplexed mode: every stream to the same url shares a websocket (per service thread), up to
+   * MOD_AUDIO_FORK_MULTIPLEX_STREAMS of them.  Binary frames in both directions carry the stream id
+   * in front of the payload, and text frames are JSON control messages with a "streamId" property:
+   * "start" (with the call id and the initial metadata), "text" (send_text and the final text) and
+   * "stop" from us; anything the far end sends is handled exactly as on a connection of its own.
+   */
+  std::string muxKey(private_t* tech_pvt) {
+    return connectionKey(tech_pvt->host, tech_pvt->port, tech_pvt->path, tech_pvt->sslFlags);
+  }
+
+  void muxStreamEstablished(service_ctx* ctx, mux_connection* mux, private_t* tech_pvt) {
+    bool notify = false;
+    switch_mutex_lock(tech_pvt->mutex);
+    if (tech_pvt->ws_state == LWS_CLIENT_DISCONNECTING) {
+      // stopped while the shared connection was still being set up: the far end never heard of it
+      mux->streams.erase(std::remove(mux->streams.begin(), mux->streams.end(), tech_pvt), mux->streams.end());
+      mux->byId.erase(tech_pvt->id);
+      tech_pvt->mux = nullptr;
+      tech_pvt->ws_state = LWS_CLIENT_DISCONNECTED;
+    }
+    else {
+      tech_pvt->wsi = mux->wsi;
+      tech_pvt->ws_state = LWS_CLIENT_CONNECTED;
+      tech_pvt->reconnects = 0;
+      tech_pvt->reconnecting = 0;
+      notify = true;
+    }
+    switch_thread_cond_signal(tech_pvt->cond);
+    switch_mutex_unlock(tech_pvt->mutex);
+
+    if (notify) {
+      groupConnected(tech_pvt);
+      ctx->connections.insert(tech_pvt);
+      tech_pvt->responseHandler(tech_pvt->sessionId, EVENT_CONNECT_SUCCESS, NULL);
+    }
+  }
+
+  void muxRetire(service_ctx* ctx, mux_connection* mux) {
+    auto it = ctx->muxes.find(mux->key);
+    if (it == ctx->muxes.end()) return;
+    it->second.erase(std::remove(it->second.begin(), it->second.end(), mux), it->second.end());
+    if (it->second.empty()) ctx->muxes.erase(it);
+  }
+
+  /* the stream has said goodbye; the connection stays up for the others, and closes once the last one has gone */
+  void muxDetach(service_ctx* ctx, mux_connection* mux, private_t* tech_pvt) {
+    mux->streams.erase(std::remove(mux->streams.begin(), mux->streams.end(), tech_pvt), mux->streams.end());
+    mux->byId.erase(tech_pvt->id);
+    ctx->connections.erase(tech_pvt);
+
+    switch_mutex_lock(tech_pvt->mutex);
+    tech_pvt->mux = nullptr;
+    tech_pvt->wsi = nullptr;
+    tech_pvt->ws_state = LWS_CLIENT_DISCONNECTED;
+    switch_thread_cond_signal(tech_pvt->cond);
+    switch_mutex_unlock(tech_pvt->mutex);
+
+    if (mux->streams.empty()) muxRetire(ctx, mux);
+  }
+
+  /* a close that missed the shutdown deadline: drop the connection without waiting for the far end */
+  void abortConnection(service_ctx* ctx, private_t* tech_pvt) {
+    if (tech_pvt->ws_state != LWS_CLIENT_DISCONNECTING) return;
+    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "(%u) aborting connection that did not close in time\n", tech_pvt->id);
+    if (tech_pvt->mux) muxDetach(ctx, (mux_connection *) tech_pvt->mux, tech_pvt);
+    else if (tech_pvt->wsi) lws_set_timeout(tech_pvt->wsi, PENDING_TIMEOUT_CLOSE_SEND, LWS_TO_KILL_ASYNC);  // CLIENT_CLOSED follows
+    else if (!cancelReconnect(ctx, tech_pvt)) {
+      // nothing on this thread refers to it, so it is closed as far as we are concerned
+      switch_mutex_lock(tech_pvt->mutex);
+      tech_pvt->ws_state = LWS_CLIENT_DISCONNECTED;
+      switch_thread_cond_signal(tech_pvt->cond);
+      switch_mutex_unlock(tech_pvt->mutex);
+    }
+  }
+
+  /* the shared connection is gone (or never came up): every stream on it goes with it */
+  void muxClosed(service_ctx* ctx, mux_connection* mux) {
+    muxRetire(ctx, mux);
+    std::vector<private_t*> streams;
+    streams.swap(mux->streams);
+    for (auto it = streams.begin(); it != streams.end(); ++it) {
+      private_t* tech_pvt = *it;
+      ctx->connections.erase(tech_pvt);
+      if (mux->state != LWS_CLIENT_CONNECTED) {
+        tech_pvt->mux = nullptr;
+        connectFailed(tech_pvt);
+        continue;
+      }
+      switch_mutex_lock(tech_pvt->mutex);
+      tech_pvt->mux = nullptr;
+      if (tech_pvt->ws_state == LWS_CLIENT_DISCONNECTING || 
+        (tech_pvt->ws_state == LWS_CLIENT_CONNECTED && !scheduleReconnect(tech_pvt))) {
+        // the media bug notices this on its next frame and tears the session down on the media thread
+        tech_pvt->ws_state = LWS_CLIENT_DISCONNECTED;
+      }
+      tech_pvt->wsi = nullptr;
+      switch_thread_cond_signal(tech_pvt->cond);
+      switch_mutex_unlock(tech_pvt->mutex);
+    }
+    delete mux;
+  }
+
+  int connect_mux(service_ctx* ctx, private_t* tech_pvt, struct lws_per_vhost_data *vhd) {
+    switch_mutex_lock(tech_pvt->mutex);
+    if (tech_pvt->ws_state != LWS_CLIENT_IDLE) {
+      tech_pvt->ws_state = LWS_CLIENT_DISCONNECTED;
+      switch_thread_cond_signal(tech_pvt->cond);
+      switch_mutex_unlock(tech_pvt->mutex);
+      return 0;
+    }
+    tech_pvt->ws_state = LWS_CLIENT_CONNECTING;
+    tech_pvt->vhd = vhd;
+    switch_mutex_unlock(tech_pvt->mutex);
+
+    // join a connection to the same url that still has room, or open a new one
+    std::string key = muxKey(tech_pvt);
+    std::vector<mux_connection*>& candidates = ctx->muxes[key];
+    mux_connection* mux = nullptr;
+    for (auto it = candidates.begin(); it != candidates.end() && !mux; ++it) {
+      if ((*it)->streams.size() < nMaxMuxStreams) mux = *it;
+    }
+    bool created = !mux;
+    if (created) {
+      mux = new mux_connection();
+      mux->key = key;
+      strncpy(mux->host, tech_pvt->host, MAX_WS_URL_LEN);
+      mux->port = tech_pvt->port;
+      strncpy(mux->path, tech_pvt->path, MAX_PATH_LEN);
+      mux->sslFlags = tech_pvt->sslFlags;
+      mux->wsi = nullptr;
+      mux->state = LWS_CLIENT_CONNECTING;
+      mux->connecting = false;
+      mux->failed = false;
+      mux->next = 0;
+      candidates.push_back(mux);
+    }
+    mux->streams.push_back(tech_pvt);
+    mux->byId[tech_pvt->id] = tech_pvt;
+    tech_pvt->mux = mux;
+
+    if (!created) {
+      switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "(%u) joining shared connection %p, now carrying %lu streams\n", 
+        tech_pvt->id, mux, mux->streams.size());
+      if (mux->state == LWS_CLIENT_CONNECTED) {
+        muxStreamEstablished(ctx, mux, tech_pvt);
+        lws_callback_on_writable(mux->wsi);
+      }
+      return 1;
+    }
+
+    struct lws_client_connect_info i;
+    memset(&i, 0, sizeof(i));
+    i.context = vhd->context;
+    i.port = mux->port;
+    std::string resolved;
+    i.address = connectAddress(mux->host, resolved);
+    i.path = mux->path;
+    i.host = mux->host;
+    i.origin = mux->host;
+    i.ssl_connection = mux->sslFlags;
+    i.protocol = myMuxSubProtocolName;
+    i.pwsi = &(mux->wsi);
+    i.userdata = mux;
+
+    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "(%u) opening shared connection %p to %s\n", tech_pvt->id, mux, key.c_str());
+    mux->connecting = true;
+    bool started = NULL != lws_client_connect_via_info(&i);
+    mux->connecting = false;
+    if (!started || mux->failed) {
+      switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "(%u) lws_client_connect_via_info failed\n", tech_pvt->id);
+      muxClosed(ctx, mux);
+      return 0;
+    }
+    return 1;
+  }
+
+  /* one binary frame for one stream, prefixed with its stream id; returns as muxWriteStream does */
+  int muxWriteAudio(private_t* tech_pvt, struct lws *wsi, bool partial) {
+    uint8_t* frame = tech_pvt->ws_send_buffer + LWS_PRE;
+    size_t maxLen = tech_pvt->ws_send_buffer_len - LWS_PRE - MUX_STREAM_ID_LEN;
+    size_t audioLen;
+    size_t datalen = readFrame(tech_pvt, frame + MUX_STREAM_ID_LEN, maxLen, audioLen, partial);
+    FORK_TRACE(TRACE_AUDIO_READ, tech_pvt->id, audioLen, datalen);
+    if (0 == datalen) return 0;
+
+    uint32_t id = tech_pvt->id;
+    frame[0] = id >> 24;
+    frame[1] = id >> 16;
+    frame[2] = id >> 8;
+    frame[3] = id;
+    return writeAudio(tech_pvt, wsi, frame, datalen + MUX_STREAM_ID_LEN, audioLen) ? 1 : -1;
+  }
+
+  /* one frame for one stream; returns 1 if something was written, 0 if the stream had nothing to send, -1 on error */
+  int muxWriteStream(service_ctx* ctx, mux_connection* mux, private_t* tech_pvt, struct lws *wsi) {
+    switch_mutex_lock(tech_pvt->mutex);
+    int state = tech_pvt->ws_state;
+    switch_mutex_unlock(tech_pvt->mutex);
+
+    if (state == LWS_CLIENT_DISCONNECTING) {
+      // everything captured before the stop goes, trailing partial frame included, then the final text
+      int rc = muxWriteAudio(tech_pvt, wsi, true);
+      if (rc == 0) rc = writeText(tech_pvt, wsi);
+      if (rc != 0) return rc;
+
+      std::string stop(LWS_PRE, '\0');
+      stop.append(muxMessage(tech_pvt, "stop", NULL, NULL));
+      int n = stop.size() - LWS_PRE;
+      if (lws_write(wsi, (unsigned char *) &stop[LWS_PRE], n, LWS_WRITE_TEXT) < n) return -1;
+      switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "(%u) stream stopped on shared connection %p\n", tech_pvt->id, mux);
+      muxDetach(ctx, mux, tech_pvt);
+      return 1;
+    }
+    if (state != LWS_CLIENT_CONNECTED) return 0;
+
+    if (tech_pvt->text_turn || !hasAudio(tech_pvt)) {
+      int rc = writeText(tech_pvt, wsi);
+      if (rc != 0) {
+        if (rc > 0) tech_pvt->text_turn = 0;
+        return rc;
+      }
+    }
+    tech_pvt->text_turn = 1;
+    return muxWriteAudio(tech_pvt, wsi, false);
+  }
+
+  void muxDispatch(mux_connection* mux, int isBinary) {
+    std::vector<uint8_t>& msg = mux->recv;
+
+    if (isBinary) {
+      if (msg.size() < MUX_STREAM_ID_LEN) {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "shared connection %p: binary message without stream id, discarding..\n", mux);
+        return;
+      }
+      uint32_t id = ((uint32_t) msg[0] << 24) | ((uint32_t) msg[1] << 16) | ((uint32_t) msg[2] << 8) | msg[3];
+      auto it = mux->byId.find(id);
+      if (it == mux->byId.end()) {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "shared connection %p: binary message for unknown stream %u\n", mux, id);
+        return;
+      }
+      processIncomingAudio(it->second, &msg[MUX_STREAM_ID_LEN], msg.size() - MUX_STREAM_ID_LEN);
+      return;
+    }
+
+    msg.push_back('\0');
+    cJSON* json = cJSON_Parse((const char *) &msg[0]);
+    if (!json) {
+      switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "shared connection %p: failed parsing json: %s\n", mux, (const char *) &msg[0]);
+      return;
+    }
+    cJSON* jsonId = cJSON_GetObjectItem(json, "streamId");
+    const char* szType = cJSON_GetObjectCstr(json, "type");
+    auto it = jsonId ? mux->byId.find((uint32_t) jsonId->valuedouble) : mux->byId.end();
+    if (!szType || it == mux->byId.end()) {
+      switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "shared connection %p: no type or unknown stream in: %s\n", mux, (const char *) &msg[0]);
+    }
+    else {
+      processJsonMessage(it->second, json, szType);
+    }
+    cJSON_Delete(json);
+  }
+
+  static int mux_callback(struct lws *wsi, 
+    enum lws_callback_reasons reason,
+    void *user, void *in, size_t len) {
+
+    mux_connection* mux = (mux_connection *) user;
+
+    switch (reason) {
+
+    case LWS_CALLBACK_CLIENT_CONNECTION_ERROR:
+      switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "mux_callback LWS_CALLBACK_CLIENT_CONNECTION_ERROR wsi: %p\n", wsi);
+      if (mux && mux->connecting) {
+        // still inside lws_client_connect_via_info, which cleans up when it returns
+        mux->failed = true;
+      }
+      else if (mux) {
+        muxClosed((service_ctx *) lws_context_user(lws_get_context(wsi)), mux);
+      }
+      break;
+
+    case LWS_CALLBACK_CLIENT_ESTABLISHED:
+      if (mux) {
+        service_ctx* ctx = (service_ctx *) lws_context_user(lws_get_context(wsi));
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "shared connection %p established to %s, carrying %lu streams\n", 
+          mux, mux->key.c_str(), mux->streams.size());
+        mux->wsi = wsi;
+        mux->state = LWS_CLIENT_CONNECTED;
+        std::vector<private_t*> streams(mux->streams);
+        for (auto it = streams.begin(); it != streams.end(); ++it) muxStreamEstablished(ctx, mux, *it);
+        if (mux->streams.empty()) muxRetire(ctx, mux);
+        lws_callback_on_writable(wsi);
+      }
+      break;
+
+    case LWS_CALLBACK_CLIENT_CLOSED:
+      if (mux) {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "shared connection %p to %s closed, %lu streams still attached\n", 
+          mux, mux->key.c_str(), mux->streams.size());
+        muxClosed((service_ctx *) lws_context_user(lws_get_context(wsi)), mux);
+      }
+      break;
+
+    case LWS_CALLBACK_CLIENT_RECEIVE:
+      if (mux) {
+        if (lws_is_first_fragment(wsi)) {
+          mux->recv.clear();
+          mux->recv.reserve(len + lws_remaining_packet_payload(wsi) + 1);
         }
-      }      
+        mux->recv.insert(mux->recv.end(), (const uint8_t *) in, (const uint8_t *) in + len);
+        if (lws_is_final_fragment(wsi)) {
+          muxDispatch(mux, lws_frame_is_binary(wsi));
+          mux->recv.clear();
+          if (mux->recv.capacity() > RECV_BUF_RETAIN_SIZE) std::vector<uint8_t>().swap(mux->recv);
+        }
+      }
+      break;
+
+    case LWS_CALLBACK_CLIENT_WRITEABLE:
+      if (mux) {
+        service_ctx* ctx = (service_ctx *) lws_context_user(lws_get_context(wsi));
+        if (mux->streams.empty()) {
+          switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "shared connection %p has no streams left, closing\n", mux);
+          lws_close_reason(wsi, LWS_CLOSE_STATUS_NORMAL, NULL, 0);
+          return -1;
+        }
+
+        if (lws_send_pipe_choked(wsi)) {
+          lws_callback_on_writable(wsi);
+          return 0;
+        }
+
+        // one write per writeable event: the next stream in turn that has something to send gets it
+        size_t n = mux->streams.size();
+        for (size_t i = 0; i < n; i++) {
+          size_t idx = (mux->next + i) % n;
+          int rc = muxWriteStream(ctx, mux, mux->streams[idx], wsi);
+          if (rc < 0) return -1;
+          if (rc > 0) {
+            mux->next = mux->streams.empty() ? 0 : (idx + 1) % mux->streams.size();
+            lws_callback_on_writable(wsi);
+            return 0;
+          }
+        }
+      }
+      return 0;
+
+    default:
+      break;
+    }
+
+    return lws_callback_http_dummy(wsi, reason, user, in, len);
+  }
+
+  void runReconnects(service_ctx* ctx) {
+    if (ctx->reconnects.empty()) return;
+    switch_time_t now = switch_micro_time_now();
+    auto due = std::partition(ctx->reconnects.begin(), ctx->reconnects.end(), 
+      [now](const std::pair<switch_time_t, private_t*>& r) { return r.first > now; });
+    std::vector<std::pair<switch_time_t, private_t*> > ready(due, ctx->reconnects.end());
+    ctx->reconnects.erase(due, ctx->reconnects.end());
+
+    // connect_client() finishes off anything that was stopped in the meantime
+    for (auto it = ready.begin(); it != ready.end(); ++it) {
+      private_t* tech_pvt = it->second;
+      if (tech_pvt->multiplexed) connect_mux(ctx, tech_pvt, tech_pvt->vhd);
+      else connect_client(tech_pvt, tech_pvt->vhd);
+    }
+  }
+
+  /**
+   * Prewarmed connections: each service thread keeps MOD_AUDIO_FORK_PREWARM_CONNECTIONS idle, already
+   * upgraded websockets to each of MOD_AUDIO_FORK_PREWARM_URLS, topped up every flush.  Until one is
+   * claimed by a session its 'user' is its pool, which is how lws_callback tells the two apart.
+   */
+  warm_pool* poolOf(service_ctx* ctx, void* user) {
+    if (!user || ctx->pools.empty()) return nullptr;
+    for (auto it = ctx->pools.begin(); it != ctx->pools.end(); ++it) {
+      if (user == &(*it)) return &(*it);
+    }
+    return nullptr;
+  }
+
+  bool connectPooled(service_ctx* ctx, warm_pool& pool) {
+    struct lws_client_connect_info i;
+
+    memset(&i, 0, sizeof(i));
+    i.context = ctx->vhd->context;
+    i.port = pool.port;
+    std::string resolved;
+    i.address = connectAddress(pool.host, resolved);
+    i.path = pool.path;
+    i.host = pool.host;
+    i.origin = pool.host;
+    i.ssl_connection = pool.sslFlags;
+    i.protocol = mySubProtocolName;
+    i.userdata = &pool;
+
+    pool.starting = true;
+    pool.startFailed = false;
+    bool started = NULL != lws_client_connect_via_info(&i);
+    pool.starting = false;
+    if (!started || pool.startFailed) return false;
+    pool.connecting++;
+    return true;
+  }
+
+  void topUpPools(service_ctx* ctx) {
+    if (ctx->pools.empty() || !ctx->vhd) return;
+    switch_time_t now = switch_micro_time_now();
+    for (auto it = ctx->pools.begin(); it != ctx->pools.end(); ++it) {
+      warm_pool& pool = *it;
+      if (now < pool.retryAt) continue;
+      while (pool.idle.size() + pool.connecting < nPrewarmConnections) {
+        if (!connectPooled(ctx, pool)) {
+          switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "failed prewarming connection to %s\n", pool.key.c_str());
+          pool.retryAt = now + nReconnectBackoffMs * 1000;
+          break;
+        }
+      }
+    }
+  }
+
+  health_probe* probeOf(service_ctx* ctx, void* user) {
+    if (!user || ctx->probes.empty()) return nullptr;
+    for (auto it = ctx->probes.begin(); it != ctx->probes.end(); ++it) {
+      if (user == &(*it)) return &(*it);
+    }
+    return nullptr;
+  }
+
+  /* an active health check is a websocket upgrade to the endpoint, closed as soon as it succeeds */
+  void runHealthChecks(service_ctx* ctx) {
+    if (ctx->probes.empty() || !ctx->vhd) return;
+    switch_time_t now = switch_micro_time_now();
+    for (auto it = ctx->probes.begin(); it != ctx->probes.end(); ++it) {
+      health_probe& probe = *it;
+      if (probe.inFlight || now < probe.nextCheck) continue;
+      group_endpoint* ep = probe.endpoint;
+      probe.nextCheck = now + (switch_time_t) nHealthCheckIntervalMs * 1000;
+
+      struct lws_client_connect_info i;
+      memset(&i, 0, sizeof(i));
+      std::string resolved;
+      i.context = ctx->vhd->context;
+      i.port = ep->port;
+      i.address = connectAddress(ep->host, resolved);
+      i.path = ep->path;
+      i.host = ep->host;
+      i.origin = ep->host;
+      i.ssl_connection = ep->sslFlags;
+      i.protocol = mySubProtocolName;
+      i.userdata = &probe;
+
+      probe.starting = true;
+      probe.startFailed = false;
+      bool started = NULL != lws_client_connect_via_info(&i);
+      probe.starting = false;
+      if (!started || probe.startFailed) {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "health check of %s failed\n", ep->url.c_str());
+        endpointFailed(ep);
+        continue;
+      }
+      probe.inFlight = true;
+    }
+  }
+
+  int probe_callback(health_probe* probe, struct lws *wsi, enum lws_callback_reasons reason) {
+    switch (reason) {
+    case LWS_CALLBACK_CLIENT_CONNECTION_ERROR:
+      if (probe->starting) {
+        probe->startFailed = true;
+        break;
+      }
+      switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "health check of %s failed\n", probe->endpoint->url.c_str());
+      endpointFailed(probe->endpoint);
+      probe->inFlight = false;
+      break;
+
+    case LWS_CALLBACK_CLIENT_ESTABLISHED:
+      endpointSucceeded(probe->endpoint);
+      probe->inFlight = false;
+      return -1;
+
+    default:
+      break;
+    }
+    return 0;
+  }
+
+  int pool_callback(service_ctx* ctx, warm_pool* pool, struct lws *wsi, enum lws_callback_reasons reason) {
+    switch (reason) {
+    case LWS_CALLBACK_CLIENT_CONNECTION_ERROR:
+      // a pool that can't be reached is left alone for a while rather than retried every flush
+      if (pool->starting) {
+        pool->startFailed = true;
+        break;
+      }
+      switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "failed prewarming connection to %s\n", pool->key.c_str());
+      dnsCache.forget(pool->host);
+      pool->connecting--;
+      pool->retryAt = switch_micro_time_now() + nReconnectBackoffMs * 1000;
+      break;
+
+    case LWS_CALLBACK_CLIENT_ESTABLISHED:
+      pool->connecting--;
+      pool->idle.push_back(wsi);
+      switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "prewarmed connection %p to %s, %lu idle\n", wsi, pool->key.c_str(), pool->idle.size());
+      break;
+
+    case LWS_CALLBACK_CLIENT_CLOSED:
+      // the far end may time out idle connections; the next flush replaces it
+      pool->idle.erase(std::remove(pool->idle.begin(), pool->idle.end(), wsi), pool->idle.end());
+      switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "prewarmed connection %p to %s closed, %lu idle\n", wsi, pool->key.c_str(), pool->idle.size());
+      break;
+
+    case LWS_CALLBACK_CLIENT_RECEIVE:
+      switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "discarding message received on idle prewarmed connection to %s\n", pool->key.c_str());
+      break;
+
+    default:
+      break;
+    }
+    return 0;
+  }
+
+  static int lws_callback(struct lws *wsi, 
+    enum lws_callback_reasons reason,
+    void *user, void *in, size_t len) {
+
+    struct lws_per_vhost_data *vhd = 
+      (struct lws_per_vhost_data *) lws_protocol_vh_priv_get(lws_get_vhost(wsi), lws_get_protocol(wsi));
+
+  	private_t* tech_pvt = (private_t *) user;
+
+    if (user && reason != LWS_CALLBACK_PROTOCOL_INIT) {
+      service_ctx* ctx = (service_ctx *) lws_context_user(lws_get_context(wsi));
+      warm_pool* pool = poolOf(ctx, user);
+      if (pool) {
+        int rc = pool_callback(ctx, pool, wsi, reason);
+        return rc ? rc : lws_callback_http_dummy(wsi, reason, NULL, in, len);
+      }
+      health_probe* probe = probeOf(ctx, user);
+      if (probe) {
+        int rc = probe_callback(probe, wsi, reason);
+        return rc ? rc : lws_callback_http_dummy(wsi, reason, NULL, in, len);
+      }
+    }
+
+    switch (reason) {
+
+    case LWS_CALLBACK_PROTOCOL_INIT:
+      switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "lws_callback LWS_CALLBACK_PROTOCOL_INIT wsi: %p\n", wsi);
+      vhd = (struct lws_per_vhost_data *) lws_protocol_vh_priv_zalloc(lws_get_vhost(wsi), lws_get_protocol(wsi), sizeof(struct lws_per_vhost_data));
+      vhd->context = lws_get_context(wsi);
+      vhd->protocol = lws_get_protocol(wsi);
+      vhd->vhost = lws_get_vhost(wsi);
+      static_cast<service_ctx *>(lws_context_user(lws_get_context(wsi)))->vhd = vhd;
+      break;
+
+    case LWS_CALLBACK_EVENT_WAIT_CANCELLED:
+      {
+        // only our own context's work is queued here, so this never walks other threads' connections
+        service_ctx* ctx = (service_ctx *) lws_context_user(lws_get_context(wsi));
+        std::vector<work_item>& items = ctx->scratch;
+        ctx->work.popAll(items);
+        for (auto it = items.begin(); it != items.end(); ++it) {
+          private_t* tech_pvt = it->tech_pvt;
+          switch (it->type) {
+            case WORK_CONNECT:
+              if (tech_pvt->multiplexed) connect_mux(ctx, tech_pvt, vhd);
+              else connect_client(tech_pvt, vhd);
+              break;
+            case WORK_WRITE:
+              if (tech_pvt->ws_state == LWS_CLIENT_CONNECTED) lws_callback_on_writable(tech_pvt->wsi);
+              break;
+            case WORK_DISCONNECT:
+              if (tech_pvt->ws_state == LWS_CLIENT_DISCONNECTING && tech_pvt->wsi) lws_callback_on_writable(tech_pvt->wsi);
+              else cancelReconnect(ctx, tech_pvt);
+              break;
+            case WORK_ABORT:
+              abortConnection(ctx, tech_pvt);
+              break;
+          }
+        }
+        items.clear();
+      }
+      break;
+
+    /* --- client callbacks --- */
+    case LWS_CALLBACK_CLIENT_CONNECTION_ERROR:
+      switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "lws_callback LWS_CALLBACK_CLIENT_CONNECTION_ERROR wsi: %p\n", wsi);
+      if (!tech_pvt) {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "LWS_CALLBACK_CLIENT_CONNECTION_ERROR unable to find pending connection for wsi: %p\n", wsi);
+      }
+      else {
+        connectFailed(tech_pvt);
+      }
+      break;
+
+
+    case LWS_CALLBACK_CLIENT_ESTABLISHED:
+      if (!tech_pvt) {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "lws_callback LWS_CALLBACK_CLIENT_ESTABLISHED unable to find pending connection for wsi: %p\n", wsi);
+      }
+      else {
+        connectionEstablished((service_ctx *) lws_context_user(lws_get_context(wsi)), tech_pvt, wsi, vhd);
+      }
       break;
 
     case LWS_CALLBACK_CLIENT_CLOSED:
       {
-        private_t* tech_pvt = *pCb;
+        if (tech_pvt) {
+          service_ctx* ctx = (service_ctx *) lws_context_user(lws_get_context(wsi));
+          ctx->connections.erase(tech_pvt);
+        }
         if (tech_pvt && tech_pvt->ws_state == LWS_CLIENT_DISCONNECTING) {
           switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "(%u) LWS_CALLBACK_CLIENT_CLOSED by us wsi: %p, context: %p, thread: %lu\n", 
             tech_pvt->id, wsi, vhd->context, switch_thread_self());
 
-          //destroy_tech_pvt(tech_pvt);
           switch_mutex_lock(tech_pvt->mutex);
+          tech_pvt->ws_state = LWS_CLIENT_DISCONNECTED;
           switch_thread_cond_signal(tech_pvt->cond);
           switch_mutex_unlock(tech_pvt->mutex);
 
@@ -430,127 +2050,464 @@ namespace {
         else if (tech_pvt && tech_pvt->ws_state == LWS_CLIENT_CONNECTED) {
           switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "(%u) LWS_CALLBACK_CLIENT_CLOSED from far end wsi: %p, context: %p, thread: %lu\n", 
             tech_pvt->id, wsi, vhd->context, switch_thread_self());
-          destroy_tech_pvt(tech_pvt);
+
+          // unless we can reconnect, the media bug notices this on its next frame and tears the session down on the media thread
+          switch_mutex_lock(tech_pvt->mutex);
+          if (!scheduleReconnect(tech_pvt)) {
+            tech_pvt->ws_state = LWS_CLIENT_DISCONNECTED;
+            tech_pvt->wsi = nullptr;
+          }
+          switch_thread_cond_signal(tech_pvt->cond);
+          switch_mutex_unlock(tech_pvt->mutex);
         }
       }
       break;
 
     case LWS_CALLBACK_CLIENT_RECEIVE:
       {
-        private_t* tech_pvt = *pCb;
         switch_mutex_lock(tech_pvt->ws_recv_mutex);
 
-        if (lws_is_first_fragment(wsi)) {
-          // allocate a buffer for the entire chunk of memory needed
-          assert(NULL == tech_pvt->recv_buf);
-          size_t bufLen = len + lws_remaining_packet_payload(wsi);
-          switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "(%u) LWS_CALLBACK_CLIENT_RECEIVE allocating %lu bytes\n", tech_pvt->id, bufLen);
-          tech_pvt->recv_buf = new uint8_t[bufLen];
-          tech_pvt->recv_buf_ptr = tech_pvt->recv_buf;
-        }
+        if (lws_is_first_fragment(wsi)) {
+          // make room up front for as much of the message as lws knows about
+          tech_pvt->recv_buf_ptr = tech_pvt->recv_buf;
+          reserveRecvBuffer(tech_pvt, len + lws_remaining_packet_payload(wsi));
+        }
+
+        // if we got any data, append it to the buffer
+        appendRecvBuffer(tech_pvt, (const uint8_t *) in, len);
+
+        if (lws_is_final_fragment(wsi)) {
+          processIncomingMessage(tech_pvt, lws_frame_is_binary(wsi));
+        }
+        switch_mutex_unlock(tech_pvt->ws_recv_mutex);
+      }
+      break;
+
+    case LWS_CALLBACK_CLIENT_WRITEABLE:
+      {
+        switch_mutex_lock(tech_pvt->mutex);
+        int state = tech_pvt->ws_state;
+        switch_mutex_unlock(tech_pvt->mutex);
+        bool disconnecting = state == LWS_CLIENT_DISCONNECTING;
+        FORK_TRACE(TRACE_WRITEABLE, tech_pvt->id, state, 0);
+
+        // on the way out, the audio captured before the stop (trailing partial frame included) and then
+        // any final text still go before the close; teardownDeadline bounds how long that may take
+        if (disconnecting) {
+          if (lws_send_pipe_choked(wsi)) {
+            lws_callback_on_writable(wsi);
+            return 0;
+          }
+          if (tech_pvt->resend_header || hasAudio(tech_pvt, true)) {
+            uint8_t* frame = tech_pvt->ws_send_buffer + LWS_PRE;
+            size_t audioLen;
+            size_t datalen = readFrame(tech_pvt, frame, tech_pvt->ws_send_buffer_len - LWS_PRE, audioLen, true);
+            FORK_TRACE(TRACE_AUDIO_READ, tech_pvt->id, audioLen, datalen);
+            if (datalen > 0 && !writeAudio(tech_pvt, wsi, frame, datalen, audioLen)) return -1;
+            lws_callback_on_writable(wsi);
+            return 0;
+          }
+          int rc = writeText(tech_pvt, wsi);
+          if (rc > 0) {
+            lws_callback_on_writable(wsi);
+            return 0;
+          }
+          switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "(%u) lws_callback LWS_CALLBACK_WRITEABLE closing connection wsi: %p\n", tech_pvt->id, wsi);
+          lws_close_reason(wsi, LWS_CLOSE_STATUS_NORMAL, NULL, 0);
+          return -1;
+        }
+
+        // lws only lets us write once it has flushed what the socket last refused, but be sure:
+        // anything unsent stays in the ring, where the backlog limit applies, until the pipe clears
+        if (lws_send_pipe_choked(wsi)) {
+          lws_callback_on_writable(wsi);
+          return 0;
+        }
+
+        // only one write per writeable event, so text and audio take turns whenever both are waiting;
+        // text goes first after connecting so the initial metadata precedes any audio
+        if (tech_pvt->text_turn || !hasAudio(tech_pvt)) {
+          int rc = writeText(tech_pvt, wsi);
+          if (rc < 0) return -1;
+          if (rc > 0) {
+            tech_pvt->text_turn = 0;
+            if (hasText(tech_pvt) || hasAudio(tech_pvt)) lws_callback_on_writable(wsi);
+            return 0;
+          }
+        }
+        tech_pvt->text_turn = 1;
+
+        // check for audio packets; the ring is drained into our own buffer because lws_write
+        // needs LWS_PRE bytes of headroom in front of the payload
+        uint8_t* frame = tech_pvt->ws_send_buffer + LWS_PRE;
+        size_t maxLen = tech_pvt->ws_send_buffer_len - LWS_PRE;
+        size_t audioLen;
+        size_t datalen = readFrame(tech_pvt, frame, maxLen, audioLen);
+        FORK_TRACE(TRACE_AUDIO_READ, tech_pvt->id, audioLen, datalen);
+
+        if (datalen > 0 && !writeAudio(tech_pvt, wsi, frame, datalen, audioLen)) return -1;
+
+        // audio that arrived while we were writing waits for the next flush, unless the codec or frame size made us stop short
+        if (hasText(tech_pvt) || ((tech_pvt->capture->message_per_packet || tech_pvt->frame_samples) && hasAudio(tech_pvt))) {
+          lws_callback_on_writable(wsi);
+        }
+
+        return 0;
+      }
+      break;
+
+    default:
+      break;
+    }
+
+    return lws_callback_http_dummy(wsi, reason, user, in, len);
+  }
+
+  static const struct lws_protocols protocols[] = {
+    {
+      mySubProtocolName,
+      lws_callback,
+      0,      /* per-session data is the private_t passed as userdata on connect */
+      1024,
+    },
+    {
+      myMuxSubProtocolName,
+      mux_callback,
+      0,      /* per-session data is the mux_connection passed as userdata on connect */
+      1024,
+    },
+    { NULL, NULL, 0, 0 }
+  };
+
+  void lws_logger(int level, const char *line) {
+    switch_log_level_t llevel = SWITCH_LOG_DEBUG;
+
+    switch (level) {
+      case LLL_ERR: llevel = SWITCH_LOG_ERROR; break;
+      case LLL_WARN: llevel = SWITCH_LOG_WARNING; break;
+      case LLL_NOTICE: llevel = SWITCH_LOG_NOTICE; break;
+      case LLL_INFO: llevel = SWITCH_LOG_INFO; break;
+      break;
+    }
+	  switch_log_printf(SWITCH_CHANNEL_LOG, llevel, "%s\n", line);
+
+  }
+
+  /**
+   * Give a destination to the service thread with the fewest, so that long calls piling up on one
+   * thread don't leave it loaded while others sit idle the way round robin can.  The count is only
+   * a hint (two sessions starting at once may both pick the same thread), which is all balancing needs.
+   * Returns false if no service thread is running to take it.
+   */
+  bool assignServiceThread(private_t* tech_pvt) {
+    unsigned int best = 0;
+    unsigned int bestLoad = UINT_MAX;
+    for (unsigned int i = 0; i < nServiceThreads; i++) {
+      unsigned int idx = (tech_pvt->id + i) % nServiceThreads;
+      if (!services[idx].context) continue;
+      unsigned int load = services[idx].nAssigned.load(std::memory_order_relaxed);
+      if (load < bestLoad) {
+        best = idx;
+        bestLoad = load;
+      }
+    }
+    if (UINT_MAX == bestLoad) return false;
+    tech_pvt->service_thread = best;
+    tech_pvt->service_assigned = 1;
+    services[best].nAssigned++;
+    return true;
+  }
+
+  /* announce the encoding, queue the initial metadata and hand the destination to its service thread */
+  switch_status_t start_destination(switch_core_session_t *session, private_t* tech_pvt, char* metadata, bool async) {
+    // anything other than L16 is announced in the initial metadata, which must then be a JSON object
+    char* announced = NULL;
+    if (AUDIO_FORK_CODEC_L16 != tech_pvt->codec) {
+      cJSON* json = metadata ? cJSON_Parse(metadata) : cJSON_CreateObject();
+      if (json && json->type == cJSON_Object) {
+        cJSON* jsonFormat = cJSON_CreateObject();
+        cJSON_AddItemToObject(jsonFormat, "encoding", cJSON_CreateString(drachtio::audio_codec_name(tech_pvt->codec)));
+        cJSON_AddItemToObject(jsonFormat, "sampleRate", cJSON_CreateNumber(tech_pvt->sampling));
+        cJSON_AddItemToObject(jsonFormat, "channels", cJSON_CreateNumber(tech_pvt->channels));
+        cJSON_AddItemToObject(json, "audioFormat", jsonFormat);
+        announced = cJSON_PrintUnformatted(json);
+        metadata = announced;
+      }
+      else {
+        switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_WARNING, 
+          "(%u) metadata is not a JSON object, unable to announce %s encoding\n", tech_pvt->id, drachtio::audio_codec_name(tech_pvt->codec));
+      }
+      if (json) cJSON_Delete(json);
+    }
+
+    // initial metadata is the first thing written once the connection is established; on a shared
+    // connection the stream is always announced, since that is how the far end learns about it
+    text_fifo* texts = static_cast<text_fifo*>(tech_pvt->text_fifo);
+    if (tech_pvt->multiplexed) texts->initial = muxMessage(tech_pvt, "start", "metadata", metadata);
+    else if (metadata) texts->initial = metadata;
+    if (!texts->initial.empty()) {
+      queueFrame(tech_pvt, texts->initial.c_str());
+      texts->initial.insert(0, LWS_PRE, '\0');
+    }
+    if (announced) free(announced);
+
+    // now try to connect
+    if (!assignServiceThread(tech_pvt)) {
+      switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR, "(%u) no service thread is running, unable to connect to %s\n", 
+        tech_pvt->id, tech_pvt->host);
+      return SWITCH_STATUS_FALSE;
+    }
+    switch_mutex_lock(tech_pvt->mutex);
+    addPendingConnect(tech_pvt);
+
+    if (async) {
+      // audio is buffered until the handshake completes, and the outcome is reported by event
+      switch_mutex_unlock(tech_pvt->mutex);
+      switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_INFO, "(%u) connecting asynchronously to host %s\n", tech_pvt->id, tech_pvt->host);
+      return SWITCH_STATUS_SUCCESS;
+    }
+
+    while (tech_pvt->ws_state == LWS_CLIENT_IDLE || tech_pvt->ws_state == LWS_CLIENT_CONNECTING) {
+      switch_thread_cond_wait(tech_pvt->cond, tech_pvt->mutex);
+    }
+
+    if (tech_pvt->ws_state == LWS_CLIENT_FAILED) {
+      switch_mutex_unlock(tech_pvt->mutex);
+      switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR, "(%u) failed connecting to host %s\n", tech_pvt->id, tech_pvt->host);
+      return SWITCH_STATUS_FALSE;
+    }
+    switch_mutex_unlock(tech_pvt->mutex);
+    switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_INFO, "(%u) successfully connected to host %s\n", tech_pvt->id, tech_pvt->host);
+    return SWITCH_STATUS_SUCCESS;
+  }
+
+  int reconnectAttempts(switch_core_session_t *session) {
+    switch_channel_t *channel = switch_core_session_get_channel(session);
+    const char* varAttempts = switch_channel_get_variable(channel, "AUDIO_FORK_RECONNECT_ATTEMPTS");
+    const char* attempts = varAttempts ? varAttempts : requestedReconnectAttempts;
+    return std::max(0, std::min(attempts ? ::atoi(attempts) : 0, 100));
+  }
+
+  bool connectMultiplexed(switch_core_session_t *session) {
+    switch_channel_t *channel = switch_core_session_get_channel(session);
+    const char* varMultiplex = switch_channel_get_variable(channel, "AUDIO_FORK_MULTIPLEX");
+    return varMultiplex ? switch_true(varMultiplex) : switch_true(requestedMultiplex);
+  }
+
+  bool framedAudio(switch_core_session_t *session) {
+    switch_channel_t *channel = switch_core_session_get_channel(session);
+    const char* varFraming = switch_channel_get_variable(channel, "AUDIO_FORK_FRAMING");
+    return varFraming ? switch_true(varFraming) : switch_true(requestedFraming);
+  }
+
+  /* samples per channel in each audio message, or 0 to send whatever has been captured at each flush */
+  uint32_t frameSamples(switch_core_session_t *session, private_t* tech_pvt) {
+    switch_channel_t *channel = switch_core_session_get_channel(session);
+    const char* varFrameMs = switch_channel_get_variable(channel, "AUDIO_FORK_FRAME_MS");
+    const char* frameMs = varFrameMs ? varFrameMs : requestedFrameMs;
+    int ms = frameMs ? ::atoi(frameMs) : 0;
+    if (ms <= 0) return 0;
+
+    // each packet is its own message for opus, so there is nothing to batch
+    if (tech_pvt->capture->message_per_packet) {
+      switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_INFO, "(%u) frame size ignored for %s\n", 
+        tech_pvt->id, drachtio::audio_codec_name(tech_pvt->codec));
+      return 0;
+    }
+
+    // a frame has to fit the send buffer, with room to spare for the audio captured while it fills
+    ms = std::max(RTP_PACKETIZATION_PERIOD, std::min(ms, std::min(1000, nAudioBufferSecs * 1000 / 2)));
+    return (uint32_t) tech_pvt->sampling * ms / 1000;
+  }
+
+  bool vadEnabled(switch_core_session_t *session) {
+    switch_channel_t *channel = switch_core_session_get_channel(session);
+    const char* varVad = switch_channel_get_variable(channel, "AUDIO_FORK_VAD");
+    return varVad ? switch_true(varVad) : switch_true(requestedVad);
+  }
+
+  bool connectAsync(switch_core_session_t *session) {
+    switch_channel_t *channel = switch_core_session_get_channel(session);
+    const char* varAsync = switch_channel_get_variable(channel, "AUDIO_FORK_ASYNC_CONNECT");
+    return varAsync ? switch_true(varAsync) : switch_true(requestedAsyncConnect);
+  }
+
+  /* start closing a destination, whatever state it is in; finishTeardown then waits for it */
+  void beginTeardown(switch_core_session_t *session, private_t* tech_pvt, char* text) {
+    switch_mutex_lock(tech_pvt->mutex);
+    if (tech_pvt->ws_state == LWS_CLIENT_CONNECTED) {
+      // the final text is queued behind anything already sent with send_text, then the connection closes
+      if (text) queueText(tech_pvt, text);
+      addPendingDisconnect(tech_pvt);
+    }
+    else if (tech_pvt->ws_state == LWS_CLIENT_IDLE || tech_pvt->ws_state == LWS_CLIENT_CONNECTING) {
+      // connect queued or in progress: the lws thread drops it or closes it as soon as the handshake completes;
+      // one that is only waiting out a reconnect backoff has to be told, or we would wait for the timer
+      bool waiting = tech_pvt->ws_state == LWS_CLIENT_IDLE && tech_pvt->reconnecting;
+      tech_pvt->ws_state = LWS_CLIENT_DISCONNECTING;
+      if (waiting) addWork(tech_pvt, WORK_DISCONNECT);
+    }
+    else if (tech_pvt->ws_state != LWS_CLIENT_FAILED && tech_pvt->ws_state != LWS_CLIENT_DISCONNECTED &&
+      tech_pvt->ws_state != LWS_CLIENT_DISCONNECTING) {
+      // closed, failed or already closing (the drain on shutdown got to it first) need nothing more; any other
+      // state we don't know how to close from normally, so the service thread drops the connection instead
+      switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR, "(%u) tearing down from unexpected ws state %d, aborting the connection\n", 
+        tech_pvt->id, tech_pvt->ws_state);
+      tech_pvt->ws_state = LWS_CLIENT_DISCONNECTING;
+      addWork(tech_pvt, WORK_ABORT);
+    }
+    switch_mutex_unlock(tech_pvt->mutex);
+  }
 
-        assert(NULL != tech_pvt->recv_buf);
-        if (len > 0) {
-          // if we got any data, append it to the buffer
-          memcpy(tech_pvt->recv_buf_ptr, in, len);
-          tech_pvt->recv_buf_ptr += len;
+  /* wait for a destination to finish closing, then free its resources */
+  void finishTeardown(switch_core_session_t *session, private_t* tech_pvt) {
+    switch_mutex_lock(tech_pvt->mutex);
+    if (tech_pvt->ws_state == LWS_CLIENT_DISCONNECTING) {
+      switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_DEBUG, "(%u) waiting to complete ws teardown\n", tech_pvt->id);
+      bool aborted = false;
+      while (tech_pvt->ws_state == LWS_CLIENT_DISCONNECTING) {
+        // the service thread still refers to the connection until it says it is closed, so an overdue
+        // close is cut short there rather than abandoned here
+        switch_time_t deadline = teardownDeadline.load();
+        switch_time_t now = switch_micro_time_now();
+        if (!deadline || now < deadline) {
+          switch_thread_cond_timedwait(tech_pvt->cond, tech_pvt->mutex, deadline ? std::min<switch_time_t>(deadline - now, TEARDOWN_POLL_USECS) : TEARDOWN_POLL_USECS);
         }
-
-        if (lws_is_final_fragment(wsi)) {
-          processIncomingMessage(tech_pvt, lws_frame_is_binary(wsi));
+        else if (!aborted) {
+          switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_WARNING, "(%u) connection to %s still closing at the drain timeout, aborting it\n", 
+            tech_pvt->id, tech_pvt->host);
+          addWork(tech_pvt, WORK_ABORT);
+          aborted = true;
+        }
+        else if (SWITCH_STATUS_TIMEOUT == switch_thread_cond_timedwait(tech_pvt->cond, tech_pvt->mutex, TEARDOWN_POLL_USECS)) {
+          switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_WARNING, "(%u) still waiting for service thread %u to abort the connection\n", 
+            tech_pvt->id, tech_pvt->service_thread);
         }
-        switch_mutex_unlock(tech_pvt->ws_recv_mutex);
       }
-      break;
+      switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_DEBUG, "(%u) teardown completed\n", tech_pvt->id);
+    }
 
-    case LWS_CALLBACK_CLIENT_WRITEABLE:
-      {
-        private_t* tech_pvt = *pCb;
-        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "(%u) LWS_CALLBACK_CLIENT_WRITEABLE\n", tech_pvt->id);
-
-        switch_mutex_lock(tech_pvt->ws_send_mutex);
-
-        // check for text frames to send
-        if (tech_pvt->metadata) {          
-          int n = tech_pvt->metadata_length - LWS_PRE - 1;
-          int m = lws_write(wsi, tech_pvt->metadata + LWS_PRE, n, LWS_WRITE_TEXT);
-          delete[] tech_pvt->metadata;
-          tech_pvt->metadata = NULL;
-          tech_pvt->metadata_length = 0;
-          if (m < n) {
-            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "(%u) error writing metadata %d requested, %d written\n", tech_pvt->id, n, m);
-            switch_mutex_unlock(tech_pvt->ws_send_mutex);
-            return -1;
-          }
-          switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "(%u) wrote %d bytes of text\n", tech_pvt->id, n);
+    // playAudio requests still being written out refer to this destination
+    while (tech_pvt->pending_playouts > 0) {
+      switch_thread_cond_wait(tech_pvt->cond, tech_pvt->mutex);
+    }
 
-          // there may be audio data, but only one write per writeable event
-          // get it next time
-          switch_mutex_unlock(tech_pvt->ws_send_mutex);
-          switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "(%u) LWS_CALLBACK_WRITEABLE sent text frame (%d bytes) wsi: %p\n", tech_pvt->id, n, wsi);
-          lws_callback_on_writable(tech_pvt->wsi);
+    switch_mutex_unlock(tech_pvt->mutex);
+    fork_stats* stats = statsOf(tech_pvt);
+    switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_INFO, "(%u) sent %llu bytes of audio to %s, dropped %llu bytes in %llu drops\n", 
+      tech_pvt->id, (unsigned long long) stats->bytesSent.load(std::memory_order_relaxed), tech_pvt->host, 
+      (unsigned long long) stats->bytesDropped.load(std::memory_order_relaxed), (unsigned long long) stats->drops.load(std::memory_order_relaxed));
+    destroy_tech_pvt(tech_pvt);
+
+    // delete any temp files
+    struct playout* playout = tech_pvt->playout;
+    while (playout) {
+      std::remove(playout->file);
+      free(playout->file);
+      struct playout *tmp = playout;
+      playout = playout->next;
+      free(tmp);
+    }
+    tech_pvt->playout = NULL;
+  }
 
-          return 0;
-        }
-        switch_mutex_unlock(tech_pvt->ws_send_mutex);
+  const char* stateName(int state) {
+    switch (state) {
+      case LWS_CLIENT_IDLE: return "idle";
+      case LWS_CLIENT_CONNECTING: return "connecting";
+      case LWS_CLIENT_CONNECTED: return "connected";
+      case LWS_CLIENT_FAILED: return "failed";
+      case LWS_CLIENT_DISCONNECTING: return "disconnecting";
+      case LWS_CLIENT_DISCONNECTED: return "disconnected";
+    }
+    return "unknown";
+  }
 
-        switch_mutex_lock(tech_pvt->mutex);
-        if (tech_pvt->ws_state == LWS_CLIENT_DISCONNECTING) {
-          switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "(%u) lws_callback LWS_CALLBACK_WRITEABLE closing connection wsi: %p\n", tech_pvt->id, wsi);
-          lws_close_reason(wsi, LWS_CLOSE_STATUS_NORMAL, NULL, 0);
-          switch_mutex_unlock(tech_pvt->mutex);
-          return -1;
-        }
+  /* the counters every destination and the module as a whole have in common */
+  void addSendStats(cJSON* json, fork_stats* stats) {
+    uint64_t messages = stats->messagesSent.load(std::memory_order_relaxed);
+    uint64_t nanos = stats->writeNanos.load(std::memory_order_relaxed);
+    cJSON_AddItemToObject(json, "messagesSent", cJSON_CreateNumber(messages));
+    cJSON_AddItemToObject(json, "bytesSent", cJSON_CreateNumber(stats->bytesSent.load(std::memory_order_relaxed)));
+    cJSON_AddItemToObject(json, "bytesDropped", cJSON_CreateNumber(stats->bytesDropped.load(std::memory_order_relaxed)));
+    cJSON_AddItemToObject(json, "drops", cJSON_CreateNumber(stats->drops.load(std::memory_order_relaxed)));
+    cJSON_AddItemToObject(json, "backlogHighWater", cJSON_CreateNumber(stats->backlogHighWater.load(std::memory_order_relaxed)));
+    cJSON_AddItemToObject(json, "writeLatencyAvgUs", cJSON_CreateNumber(messages ? nanos / messages / 1000 : 0));
+    cJSON_AddItemToObject(json, "writeLatencyMaxUs", cJSON_CreateNumber(stats->writeNanosMax.load(std::memory_order_relaxed) / 1000));
+    cJSON_AddItemToObject(json, "reconnects", cJSON_CreateNumber(stats->reconnects.load(std::memory_order_relaxed)));
+  }
 
-        // check for audio packets
-        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "(%u) (lwsthread) offset %lu\n", tech_pvt->id, tech_pvt->ws_audio_buffer_write_offset);
+  void addCaptureStats(cJSON* json, fork_stats* stats) {
+    cJSON_AddItemToObject(json, "framesCaptured", cJSON_CreateNumber(stats->framesCaptured.load(std::memory_order_relaxed)));
+    cJSON_AddItemToObject(json, "bytesCaptured", cJSON_CreateNumber(stats->bytesCaptured.load(std::memory_order_relaxed)));
+    cJSON_AddItemToObject(json, "captureDrops", cJSON_CreateNumber(stats->captureDrops.load(std::memory_order_relaxed)));
+    cJSON_AddItemToObject(json, "framesSuppressed", cJSON_CreateNumber(stats->framesSuppressed.load(std::memory_order_relaxed)));
+  }
 
-        if (tech_pvt->ws_audio_buffer_write_offset > LWS_PRE) {
-          size_t datalen = tech_pvt->ws_audio_buffer_write_offset - LWS_PRE;
-          int sent = lws_write(wsi, (unsigned char *) tech_pvt->ws_audio_buffer + LWS_PRE, datalen, LWS_WRITE_BINARY);
-          if (sent < datalen) {
-            switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, 
-            "(%u)  LWS_CALLBACK_WRITEABLE wrote only %u of %lu bytes wsi: %p\n", 
-              tech_pvt->id, sent, datalen, wsi);
-          }
-          initAudioBuffer(tech_pvt);
-        }
+  /* queue text for one destination; returns false if it is neither connected nor reconnecting */
+  bool sendText(private_t* dest, const char* text) {
+    // while reconnecting it waits in the queue, and goes out once the connection is back
+    switch_mutex_lock(dest->mutex);
+    bool reconnecting = dest->reconnecting && (dest->ws_state == LWS_CLIENT_IDLE || dest->ws_state == LWS_CLIENT_CONNECTING);
+    if (!reconnecting && (dest->ws_state != LWS_CLIENT_CONNECTED || !dest->wsi)) {
+      switch_mutex_unlock(dest->mutex);
+      return false;
+    }
 
-        switch_mutex_unlock(tech_pvt->mutex);
+    // frames go out in the order they were queued, interleaved with audio
+    queueText(dest, text);
+    addPendingWrite(dest);
+    switch_mutex_unlock(dest->mutex);
+    return true;
+  }
 
-        return 0;
-      }
-      break;
+  /* tell every destination that speech started or stopped, along with the sequence number of the next packet */
+  void notifySpeech(private_t* tech_pvt, const char* type) {
+    cJSON* json = cJSON_CreateObject();
+    cJSON_AddItemToObject(json, "type", cJSON_CreateString(type));
+    cJSON_AddItemToObject(json, "sequence", cJSON_CreateNumber(tech_pvt->sequence));
+    cJSON_AddItemToObject(json, "timestamp", cJSON_CreateNumber(switch_micro_time_now()));
+    char* text = cJSON_PrintUnformatted(json);
+    cJSON_Delete(json);
+
+    for (private_t* dest = tech_pvt; dest; dest = dest->next_destination) sendText(dest, text);
+    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "(%u) %s\n", tech_pvt->id, type);
+    free(text);
+  }
 
-    default:
-      break;
+  /**
+   * Run a frame through the voice activity detector; returns true if it is speech and should be forked.
+   * Speech starting forks the held preroll first.  Transitions are rare, so they are the one time the
+   * media thread takes a destination's lock and wakes its service thread, to send them as text.
+   */
+  bool gateSpeech(private_t* tech_pvt, const int16_t* pcm, size_t count, 
+    const uint8_t* data, size_t len, uint32_t samples, int64_t captured, const drachtio::EnergyVad::Sink& sink) {
+    drachtio::EnergyVad* vad = static_cast<drachtio::EnergyVad*>(tech_pvt->vad);
+    drachtio::EnergyVad::Transition transition = vad->classify(pcm, count, samples);
+    if (transition == drachtio::EnergyVad::VAD_SPEECH_START) {
+      notifySpeech(tech_pvt, "speech_start");
+      vad->release(sink);
+    }
+    else if (transition == drachtio::EnergyVad::VAD_SPEECH_STOP) {
+      notifySpeech(tech_pvt, "speech_stop");
     }
+    if (vad->speaking()) return true;
 
-    return lws_callback_http_dummy(wsi, reason, user, in, len);
+    vad->hold(data, len, samples, captured);
+    bump(statsOf(tech_pvt)->framesSuppressed, 1);
+    bump(totals.framesSuppressed, 1);
+    return false;
   }
 
-  static const struct lws_protocols protocols[] = {
-    {
-      mySubProtocolName,
-      lws_callback,
-      sizeof(void *),
-      1024,
-    },
-    { NULL, NULL, 0, 0 }
-  };
-
-  void lws_logger(int level, const char *line) {
-    switch_log_level_t llevel = SWITCH_LOG_DEBUG;
-
-    switch (level) {
-      case LLL_ERR: llevel = SWITCH_LOG_ERROR; break;
-      case LLL_WARN: llevel = SWITCH_LOG_WARNING; break;
-      case LLL_NOTICE: llevel = SWITCH_LOG_NOTICE; break;
-      case LLL_INFO: llevel = SWITCH_LOG_INFO; break;
-      break;
+  /* 1 if any destination still wants audio, 0 if they are all closing, -1 if they are all gone */
+  int captureState(private_t* tech_pvt) {
+    int rc = -1;
+    for (private_t* dest = tech_pvt; dest; dest = dest->next_destination) {
+      int state = dest->ws_state;
+      if (state == LWS_CLIENT_IDLE || state == LWS_CLIENT_CONNECTING || state == LWS_CLIENT_CONNECTED) return 1;
+      if (state == LWS_CLIENT_DISCONNECTING) rc = 0;
     }
-	  switch_log_printf(SWITCH_CHANNEL_LOG, llevel, "%s\n", line);
-
+    return rc;
   }
 
 }
@@ -607,12 +2564,171 @@ extern "C" {
     return 1;
   }
 
+  void fork_trace(int enable) {
+#if defined(AUDIO_FORK_NO_TRACE)
+    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "mod_audio_fork: built without tracing\n");
+#else
+    drachtio::TraceLog::enable(enable != 0);
+    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "mod_audio_fork: tracing %s, %d entries per thread\n", 
+      enable ? "on" : "off", nTraceEntries);
+#endif
+  }
+
+  // the caller frees the returned text
+  char* fork_trace_dump(void) {
+    std::vector<drachtio::trace_entry> entries;
+    drachtio::TraceLog::snapshot(entries);
+
+    std::string text;
+    char line[128];
+    for (auto it = entries.begin(); it != entries.end(); ++it) {
+      snprintf(line, sizeof(line), "%lld (%u) %s %llu %llu\n", (long long) it->when, it->id, traceEventName(it->event), 
+        (unsigned long long) it->a, (unsigned long long) it->b);
+      text += line;
+    }
+    return strdup(text.c_str());
+  }
+
   switch_status_t fork_init() {
-  return SWITCH_STATUS_SUCCESS;
+    loadGroups();
+    drachtio::TraceLog::configure(nTraceEntries);
+    if (requestedTrace && switch_true(requestedTrace)) fork_trace(1);
+    for (unsigned int i = 0; i < nPlayoutThreads; i++) {
+      playoutWorkers.emplace_back(new playout_worker);
+      playoutWorkers.back()->thread = std::thread(playout_thread, playoutWorkers.back().get());
+    }
+    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "mod_audio_fork: started %u playout threads\n", nPlayoutThreads);
+    return SWITCH_STATUS_SUCCESS;
+  }
+
+  /* mark a fork's teardown as begun; false if something else already began it */
+  bool claimTeardown(const std::string& sessionId) {
+    std::lock_guard<std::mutex> lk(liveForksMutex);
+    auto it = liveForks.find(sessionId);
+    if (it == liveForks.end() || it->second) return false;
+    it->second = true;
+    return true;
+  }
+
+  /**
+   * Claim every fork whose teardown has not begun, lock its session so it can't go away while we close
+   * it, and start closing its connections.  That happens under liveForksMutex, so a stop or hangup can
+   * only get to the fork before (and then it is skipped) or after (and then it finds it closing).
+   */
+  std::vector<switch_core_session_t*> claimLiveForks() {
+    std::vector<switch_core_session_t*> sessions;
+    std::lock_guard<std::mutex> lk(liveForksMutex);
+    for (auto it = liveForks.begin(); it != liveForks.end(); ++it) {
+      if (it->second) continue;
+      switch_core_session_t* session = switch_core_session_locate(it->first.c_str());
+      if (!session) continue;
+      switch_channel_t *channel = switch_core_session_get_channel(session);
+      switch_media_bug_t *bug = (switch_media_bug_t*) switch_channel_get_private(channel, MY_BUG_NAME);
+      private_t* tech_pvt = bug ? (private_t*) switch_core_media_bug_get_user_data(bug) : nullptr;
+      if (!tech_pvt) {
+        switch_core_session_rwunlock(session);
+        continue;
+      }
+      it->second = true;
+      for (private_t* dest = tech_pvt; dest; dest = dest->next_destination) beginTeardown(session, dest, NULL);
+      sessions.push_back(session);
+    }
+    return sessions;
+  }
+
+  /**
+   * Stop every fork still in progress the way the stop command does: whatever audio and text is
+   * queued is sent, then the close frame.  All the connections are told to close before waiting
+   * on any of them, so the drain takes as long as the slowest one rather than the sum of them.
+   * Forks already being stopped by someone else are left to them, but waited for.  A fork that can't
+   * be claimed yet (its bug is still being attached, or its session is going away) is tried again
+   * until the deadline, after which only the teardowns already running are waited for.
+   */
+  void drainForks(std::chrono::steady_clock::time_point deadline) {
+    for (;;) {
+      std::vector<switch_core_session_t*> sessions = claimLiveForks();
+      if (!sessions.empty()) {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "mod_audio_fork: draining %lu forks\n", sessions.size());
+      }
+
+      // removing the bug runs fork_session_cleanup, which waits for the close we started above
+      for (auto it = sessions.begin(); it != sessions.end(); ++it) {
+        switch_channel_t *channel = switch_core_session_get_channel(*it);
+        switch_media_bug_t *bug = (switch_media_bug_t*) switch_channel_get_private(channel, MY_BUG_NAME);
+        if (bug) switch_core_media_bug_remove(*it, &bug);
+        switch_core_session_rwunlock(*it);
+      }
+
+      std::unique_lock<std::mutex> lk(liveForksMutex);
+      if (liveForks.empty()) return;
+      auto now = std::chrono::steady_clock::now();
+      if (now >= deadline) break;
+      liveForksStopped.wait_until(lk, std::min(deadline, now + std::chrono::milliseconds(100)));
+    }
+
+    // teardowns begun elsewhere are bounded by teardownDeadline too, but until they finish they run our code
+    std::unique_lock<std::mutex> lk(liveForksMutex);
+    auto stopped = [] {
+      return std::none_of(liveForks.begin(), liveForks.end(), [](const std::pair<const std::string, bool>& fork) { return fork.second; });
+    };
+    while (!liveForksStopped.wait_for(lk, std::chrono::seconds(5), stopped)) {
+      switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "mod_audio_fork: waiting for forks that are still being stopped\n");
+    }
+    if (!liveForks.empty()) {
+      switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "mod_audio_fork: %lu forks could not be stopped within the %d ms drain timeout\n", 
+        liveForks.size(), nDrainTimeoutMs);
+    }
+  }
+
+  /* ask the service threads to exit and wait for them: past the deadline we log, but keep waiting, since their code is about to be unloaded */
+  void stopServiceThreads(std::chrono::steady_clock::time_point deadline) {
+    stopServices = true;
+    for (unsigned int i = 0; i < nServiceThreads; i++) {
+      struct lws_context* context = services[i].context.load();
+      if (context) lws_cancel_service(context);
+    }
+
+    std::unique_lock<std::mutex> lk(serviceThreadsMutex);
+    auto stopped = [] { return 0 == nRunningServiceThreads; };
+    if (!serviceThreadsExited.wait_until(lk, deadline, stopped)) {
+      do {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "mod_audio_fork: %u service threads still running after the %d ms drain timeout, waiting for them\n", 
+          nRunningServiceThreads, nDrainTimeoutMs);
+      } while (!serviceThreadsExited.wait_for(lk, std::chrono::seconds(5), stopped));
+    }
+    for (auto& t : serviceThreads) t.join();
+    serviceThreads.clear();
+    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "mod_audio_fork: service threads stopped\n");
+  }
+
+  void fork_drain(int enable) {
+    draining = enable != 0;
+    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "mod_audio_fork: %s, %d calls being forked\n", 
+      enable ? "draining, new forks will be refused" : "no longer draining", activeCalls.load());
   }
 
   switch_status_t fork_cleanup() {
-      return SWITCH_STATUS_SUCCESS;
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(nDrainTimeoutMs);
+    teardownDeadline = switch_micro_time_now() + nDrainTimeoutMs * 1000LL;
+    draining = true;
+    drainForks(deadline);
+
+    // workers finish whatever is queued before exiting, since sessions may be waiting on it
+    for (auto& worker : playoutWorkers) {
+      {
+        std::lock_guard<std::mutex> lk(worker->mutex);
+        worker->stopping = true;
+      }
+      worker->cond.notify_one();
+    }
+    for (auto& worker : playoutWorkers) {
+      if (worker->thread.joinable()) worker->thread.join();
+    }
+
+    // a service thread may still be handing out playout jobs until it exits
+    stopServiceThreads(deadline);
+    playoutWorkers.clear();
+    return SWITCH_STATUS_SUCCESS;
   }
 
   switch_status_t fork_session_init(switch_core_session_t *session, 
@@ -621,13 +2737,22 @@ extern "C" {
               char *host,
               unsigned int port,
               char *path,
+              char *group,
               int sampling,
+              int codec,
               int sslFlags,
               int channels,
               char* metadata, 
               void **ppUserData)
   {    	
-    int err;
+    if (draining) {
+      switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_WARNING, "mod_audio_fork is draining, refusing to start a new fork\n");
+      return SWITCH_STATUS_FALSE;
+    }
+
+    switch_channel_t *channel = switch_core_session_get_channel(session);
+    const char* varPlayback = switch_channel_get_variable(channel, "AUDIO_FORK_STREAMING_PLAYBACK");
+    bool streamingPlayback = varPlayback ? switch_true(varPlayback) : switch_true(requestedStreamingPlayback);
 
     // allocate per-session data structure
     private_t* tech_pvt = (private_t *) switch_core_session_alloc(session, sizeof(private_t));
@@ -635,41 +2760,102 @@ extern "C" {
       switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR, "error allocating memory!\n");
       return SWITCH_STATUS_FALSE;
     }
-    if (SWITCH_STATUS_SUCCESS != fork_data_init(tech_pvt, session, host, port, path, sslFlags, samples_per_second, sampling, channels, metadata, responseHandler)) {
+    if (SWITCH_STATUS_SUCCESS != fork_data_init(tech_pvt, NULL, session, host, port, path, sslFlags, sampling, codec, channels, responseHandler) ||
+      (group && !joinGroup(session, tech_pvt, group))) {
+      destroy_tech_pvt(tech_pvt);
+      return SWITCH_STATUS_FALSE;
+    }
+    tech_pvt->max_reconnects = reconnectAttempts(session);
+    tech_pvt->framing = framedAudio(session);
+    if (SWITCH_STATUS_SUCCESS != capture_init(tech_pvt, session, samples_per_second)) {
       destroy_tech_pvt(tech_pvt);
+      release_dsp(tech_pvt);
       return SWITCH_STATUS_FALSE;
     }
+    tech_pvt->frame_samples = frameSamples(session, tech_pvt);
+    if (vadEnabled(session)) {
+      tech_pvt->vad = new drachtio::EnergyVad(sampling, nVadThresholdDb, nVadHangoverMs, nVadPrerollMs);
+      switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_DEBUG, "(%u) voice activity detection enabled, threshold %d dBFS, hangover %d ms\n", 
+        tech_pvt->id, nVadThresholdDb, nVadHangoverMs);
+    }
 
-    // now try to connect
-    unsigned int nSelectedServiceThread = tech_pvt->id % nServiceThreads;
-    switch_mutex_lock(tech_pvt->mutex);
-    addPendingConnect(tech_pvt);
-    lws_cancel_service(context[nSelectedServiceThread]);
-    switch_thread_cond_wait(tech_pvt->cond, tech_pvt->mutex);
+    // binary frames from the far end are L16 mono at the fork's sampling rate, played out through the media bug
+    if (streamingPlayback) {
+      switch_codec_t* write_codec = switch_core_session_get_write_codec(session);
+      uint32_t channelRate = write_codec && write_codec->implementation ? 
+        write_codec->implementation->actual_samples_per_second : samples_per_second;
+      drachtio::PlaybackBuffer* playback = new drachtio::PlaybackBuffer(sampling, channelRate, nAudioBufferSecs * 1000, nPlaybackPrebufferMs);
+      std::string error;
+      if (!playback->init(SWITCH_RESAMPLE_QUALITY, error)) {
+        switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR, "Error initializing playback resampler: %s.\n", error.c_str());
+        delete playback;
+        destroy_tech_pvt(tech_pvt);
+        release_dsp(tech_pvt);
+        return SWITCH_STATUS_FALSE;
+      }
+      tech_pvt->playback = playback;
+      switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_DEBUG, "(%u) streaming playback enabled, %d Hz to %u Hz\n", 
+        tech_pvt->id, sampling, channelRate);
+    }
 
-    if (tech_pvt->ws_state == LWS_CLIENT_FAILED) {
-      switch_mutex_unlock(tech_pvt->mutex);
-      switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR, "(%u) failed connecting to host %s\n", tech_pvt->id, host);
+    tech_pvt->multiplexed = connectMultiplexed(session);
+    if (SWITCH_STATUS_SUCCESS != start_destination(session, tech_pvt, metadata, connectAsync(session))) {
       destroy_tech_pvt(tech_pvt);
+      release_dsp(tech_pvt);
       return SWITCH_STATUS_FALSE;
     }
-    switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_INFO, "(%u) successfully connected to host %s\n", tech_pvt->id, host);
 
-    // write initial metadata
-    if (metadata) {
-      tech_pvt->metadata_length = strlen(metadata) + 1 + LWS_PRE;
-      tech_pvt->metadata = new uint8_t[tech_pvt->metadata_length];
-      memset(tech_pvt->metadata, 0, tech_pvt->metadata_length);
-      memcpy(tech_pvt->metadata + LWS_PRE, metadata, strlen(metadata));
-      addPendingWrite(tech_pvt);
-      lws_cancel_service(tech_pvt->vhd->context);
+    {
+      std::lock_guard<std::mutex> lk(liveForksMutex);
+      liveForks[tech_pvt->sessionId] = false;
     }
-    switch_mutex_unlock(tech_pvt->mutex);
-
+    activeCalls++;
     *ppUserData = tech_pvt;
     return SWITCH_STATUS_SUCCESS;
   }
 
+  // must be called before the media bug is added: the capture walks the list of destinations without locking it
+  switch_status_t fork_session_add_destination(switch_core_session_t *session, void *pUserData,
+              char *host,
+              unsigned int port,
+              char *path,
+              char *group,
+              int sslFlags,
+              char* metadata)
+  {
+    private_t* capture = (private_t*) pUserData;
+    private_t* tech_pvt = (private_t *) switch_core_session_alloc(session, sizeof(private_t));
+    if (!tech_pvt) {
+      switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR, "error allocating memory!\n");
+      return SWITCH_STATUS_FALSE;
+    }
+    if (SWITCH_STATUS_SUCCESS != fork_data_init(tech_pvt, capture, session, host, port, path, sslFlags, 
+      capture->sampling, capture->codec, capture->channels, capture->responseHandler) ||
+      (group && !joinGroup(session, tech_pvt, group))) {
+      destroy_tech_pvt(tech_pvt);
+      return SWITCH_STATUS_FALSE;
+    }
+
+    tech_pvt->max_reconnects = reconnectAttempts(session);
+    tech_pvt->framing = capture->framing;
+    tech_pvt->frame_samples = capture->frame_samples;
+
+    // each destination reads the shared capture from wherever the capture is now
+    tech_pvt->audio_cursor = static_cast<drachtio::BroadcastRing*>(capture->audio_ring)->head();
+
+    tech_pvt->multiplexed = connectMultiplexed(session);
+    if (SWITCH_STATUS_SUCCESS != start_destination(session, tech_pvt, metadata, connectAsync(session))) {
+      destroy_tech_pvt(tech_pvt);
+      return SWITCH_STATUS_FALSE;
+    }
+
+    private_t* last = capture;
+    while (last->next_destination) last = last->next_destination;
+    last->next_destination = tech_pvt;
+    switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_DEBUG, "(%u) added destination (%u) %s\n", capture->id, tech_pvt->id, host);
+    return SWITCH_STATUS_SUCCESS;
+  }
+
   switch_status_t fork_session_cleanup(switch_core_session_t *session, char* text) {
     switch_channel_t *channel = switch_core_session_get_channel(session);
     switch_media_bug_t *bug = (switch_media_bug_t*) switch_channel_get_private(channel, MY_BUG_NAME);
@@ -678,58 +2864,64 @@ extern "C" {
       return SWITCH_STATUS_FALSE;
     }
     private_t* tech_pvt = (private_t*) switch_core_media_bug_get_user_data(bug);
+    if (!tech_pvt) return SWITCH_STATUS_FALSE;
     uint32_t id = tech_pvt->id;
+    std::string sessionId(tech_pvt->sessionId);
+    if (!text) text = tech_pvt->final_text;
 
     switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_DEBUG, "(%u) fork_session_cleanup\n", id);
 
-    if (!tech_pvt || !tech_pvt->wsi) return SWITCH_STATUS_FALSE;
-      
-    switch_mutex_lock(tech_pvt->mutex);
+    // from here on the drain leaves this fork to us (if it hasn't begun closing it already)
+    claimTeardown(sessionId);
 
-    if (tech_pvt->ws_state != LWS_CLIENT_CONNECTED) {
-      switch_mutex_unlock(tech_pvt->mutex);
-      switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR, "(%u) fork_session_cleanup failed because ws state is %d\n", tech_pvt->id, tech_pvt->ws_state);
-      return SWITCH_STATUS_FALSE;
+    // close every destination at once, so the slowest one bounds the wait rather than the sum of them;
+    // each is closed and freed whatever happens to the others, since the bug and its pool go next
+    for (private_t* dest = tech_pvt; dest; dest = dest->next_destination) {
+      beginTeardown(session, dest, text);
+    }
+    for (private_t* dest = tech_pvt; dest; dest = dest->next_destination) {
+      finishTeardown(session, dest);
     }
-    else {
-      if (text) {
-        tech_pvt->metadata_length = strlen(text) + 1 + LWS_PRE;
-        tech_pvt->metadata = new uint8_t[tech_pvt->metadata_length];
-        memset(tech_pvt->metadata, 0, tech_pvt->metadata_length);
-        memcpy(tech_pvt->metadata + LWS_PRE, text, strlen(text));
-        addPendingWrite(tech_pvt);
-      }
-
-      addPendingDisconnect(tech_pvt);
-      lws_cancel_service(tech_pvt->vhd->context);
-      switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_DEBUG, "(%u) waiting to complete ws teardown\n", id);
-
-      // wait for disconnect to complete
-      switch_thread_cond_wait(tech_pvt->cond, tech_pvt->mutex);
-      switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_DEBUG, "(%u) teardown completed\n", id);
 
-      switch_mutex_unlock(tech_pvt->mutex);
-      destroy_tech_pvt(tech_pvt);
+    switch_channel_set_private(channel, MY_BUG_NAME, NULL);
+    {
+      std::lock_guard<std::mutex> lk(liveForksMutex);
+      liveForks.erase(sessionId);
+      liveForksStopped.notify_all();
+    }
+    activeCalls--;
 
-      // delete any temp files
-      struct playout* playout = tech_pvt->playout;
-      while (playout) {
-        std::remove(playout->file);
-        free(playout->file);
-        struct playout *tmp = playout;
-        playout = playout->next;
-        free(tmp);
-      }
+    switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_INFO, "(%u) fork_session_cleanup: connection closed\n", id);
+    return SWITCH_STATUS_SUCCESS;
+  }
 
-      switch_channel_t *channel = switch_core_session_get_channel(session);
-      switch_media_bug_t *bug = (switch_media_bug_t*) switch_channel_get_private(channel, MY_BUG_NAME);
-      if (bug) {
-        switch_channel_set_private(channel, MY_BUG_NAME, NULL);
-      }
+  /**
+   * Stop forking on request.  The teardown runs from the bug's close callback rather than here, so it
+   * waits for a frame the media thread is processing (which may be sending text to the destinations)
+   * instead of destroying their state under it.
+   */
+  switch_status_t fork_session_stop(switch_core_session_t *session, char* text) {
+    switch_channel_t *channel = switch_core_session_get_channel(session);
+    switch_media_bug_t *bug = (switch_media_bug_t*) switch_channel_get_private(channel, MY_BUG_NAME);
+    if (!bug) {
+      switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR, "fork_session_stop failed because no bug\n");
+      return SWITCH_STATUS_FALSE;
+    }
+    private_t* tech_pvt = (private_t*) switch_core_media_bug_get_user_data(bug);
+    if (!tech_pvt) return SWITCH_STATUS_FALSE;
 
-      switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_INFO, "(%u) fork_session_cleanup: connection closed\n", id);
+    // the drain (or an earlier stop) may already be closing the connections, and the bug with them
+    if (!claimTeardown(tech_pvt->sessionId)) {
+      switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_INFO, "(%u) fork_session_stop: already stopping\n", tech_pvt->id);
+      return SWITCH_STATUS_SUCCESS;
     }
-    return SWITCH_STATUS_SUCCESS;
+    if (text) tech_pvt->final_text = switch_core_session_strdup(session, text);
+    return switch_core_media_bug_remove(session, &bug);
+  }
+
+  void fork_session_release(void *pUserData) {
+    private_t* tech_pvt = (private_t*) pUserData;
+    if (tech_pvt) release_dsp(tech_pvt);
   }
 
   switch_status_t fork_session_send_text(switch_core_session_t *session, char* text) {
@@ -740,131 +2932,363 @@ extern "C" {
       return SWITCH_STATUS_FALSE;
     }
     private_t* tech_pvt = (private_t*) switch_core_media_bug_get_user_data(bug);
-  
-    if (!tech_pvt || !tech_pvt->wsi) return SWITCH_STATUS_FALSE;
-      
-    switch_mutex_lock(tech_pvt->ws_send_mutex);
-    if (tech_pvt->ws_state != LWS_CLIENT_CONNECTED) {
-      switch_mutex_unlock(tech_pvt->ws_send_mutex);
-      switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR, "(%u) fork_session_send_text failed because ws state is %d\n", tech_pvt->id, tech_pvt->ws_state);
-      return SWITCH_STATUS_FALSE;
+    if (!tech_pvt) return SWITCH_STATUS_FALSE;
+
+    // text goes to every destination that is currently connected (or reconnecting)
+    switch_status_t status = SWITCH_STATUS_FALSE;
+    for (private_t* dest = tech_pvt; dest; dest = dest->next_destination) {
+      if (!sendText(dest, text)) {
+        switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR, "(%u) fork_session_send_text failed because ws state is %d\n", dest->id, dest->ws_state);
+        continue;
+      }
+      status = SWITCH_STATUS_SUCCESS;
     }
-    else {
-      tech_pvt->metadata_length = strlen(text) + 1 + LWS_PRE;
-      tech_pvt->metadata = new uint8_t[tech_pvt->metadata_length];
-      memset(tech_pvt->metadata, 0, tech_pvt->metadata_length);
-      memcpy(tech_pvt->metadata + LWS_PRE, text, strlen(text));
+    return status;
+  }
+
+  // the caller frees the returned JSON
+  char* fork_session_stats(switch_core_session_t *session) {
+    switch_channel_t *channel = switch_core_session_get_channel(session);
+    switch_media_bug_t *bug = (switch_media_bug_t*) switch_channel_get_private(channel, MY_BUG_NAME);
+    if (!bug) return NULL;
+    private_t* tech_pvt = (private_t*) switch_core_media_bug_get_user_data(bug);
+    if (!tech_pvt) return NULL;
+
+    cJSON* json = cJSON_CreateObject();
+    cJSON_AddItemToObject(json, "id", cJSON_CreateNumber(tech_pvt->id));
+    cJSON_AddItemToObject(json, "codec", cJSON_CreateString(drachtio::audio_codec_name(tech_pvt->codec)));
+    cJSON_AddItemToObject(json, "sampleRate", cJSON_CreateNumber(tech_pvt->sampling));
+    cJSON_AddItemToObject(json, "channels", cJSON_CreateNumber(tech_pvt->channels));
+    cJSON_AddItemToObject(json, "bufferSize", cJSON_CreateNumber(static_cast<drachtio::BroadcastRing*>(tech_pvt->audio_ring)->capacity()));
+    addCaptureStats(json, statsOf(tech_pvt));
+
+    cJSON* destinations = cJSON_CreateArray();
+    for (private_t* dest = tech_pvt; dest; dest = dest->next_destination) {
+      cJSON* jsonDest = cJSON_CreateObject();
+      cJSON_AddItemToObject(jsonDest, "id", cJSON_CreateNumber(dest->id));
+      cJSON_AddItemToObject(jsonDest, "host", cJSON_CreateString(dest->host));
+      cJSON_AddItemToObject(jsonDest, "state", cJSON_CreateString(stateName(dest->ws_state)));
+      cJSON_AddItemToObject(jsonDest, "serviceThread", cJSON_CreateNumber(dest->service_thread));
+      cJSON_AddItemToObject(jsonDest, "multiplexed", cJSON_CreateBool(dest->multiplexed));
+      addSendStats(jsonDest, statsOf(dest));
+      cJSON_AddItemToArray(destinations, jsonDest);
+    }
+    cJSON_AddItemToObject(json, "destinations", destinations);
 
-      addPendingWrite(tech_pvt);
-      lws_cancel_service(tech_pvt->vhd->context);
-      switch_mutex_unlock(tech_pvt->ws_send_mutex);
+    char* text = cJSON_Print(json);
+    cJSON_Delete(json);
+    return text;
+  }
+
+  // the caller frees the returned JSON
+  char* fork_module_stats(void) {
+    cJSON* json = cJSON_CreateObject();
+    cJSON_AddItemToObject(json, "activeCalls", cJSON_CreateNumber(activeCalls.load()));
+    cJSON_AddItemToObject(json, "draining", cJSON_CreateBool(draining.load()));
+    cJSON_AddItemToObject(json, "bufferSecs", cJSON_CreateNumber(nAudioBufferSecs));
+    cJSON_AddItemToObject(json, "flushIntervalMs", cJSON_CreateNumber(nFlushIntervalMs));
+    addCaptureStats(json, &totals);
+    addSendStats(json, &totals);
+
+    cJSON* threads = cJSON_CreateArray();
+    for (unsigned int i = 0; i < nServiceThreads; i++) {
+      cJSON* jsonThread = cJSON_CreateObject();
+      cJSON_AddItemToObject(jsonThread, "thread", cJSON_CreateNumber(i));
+      cJSON_AddItemToObject(jsonThread, "running", cJSON_CreateBool(NULL != services[i].context.load()));
+      cJSON_AddItemToObject(jsonThread, "assigned", cJSON_CreateNumber(services[i].nAssigned.load(std::memory_order_relaxed)));
+      cJSON_AddItemToObject(jsonThread, "connections", cJSON_CreateNumber(services[i].nConnections.load(std::memory_order_relaxed)));
+      cJSON_AddItemToObject(jsonThread, "sharedConnections", cJSON_CreateNumber(services[i].nShared.load(std::memory_order_relaxed)));
+      cJSON_AddItemToObject(jsonThread, "prewarmed", cJSON_CreateNumber(services[i].nWarm.load(std::memory_order_relaxed)));
+      cJSON_AddItemToObject(jsonThread, "reconnecting", cJSON_CreateNumber(services[i].nReconnecting.load(std::memory_order_relaxed)));
+      cJSON_AddItemToArray(threads, jsonThread);
     }
-    return SWITCH_STATUS_SUCCESS;
+    cJSON_AddItemToObject(json, "serviceThreads", threads);
+
+    cJSON* jsonGroups = cJSON_CreateArray();
+    switch_time_t now = switch_micro_time_now();
+    for (auto it = groups.begin(); it != groups.end(); ++it) {
+      cJSON* jsonGroup = cJSON_CreateObject();
+      cJSON_AddItemToObject(jsonGroup, "name", cJSON_CreateString(it->first.c_str()));
+      cJSON_AddItemToObject(jsonGroup, "policy", cJSON_CreateString(it->second->hashByUuid ? "hash" : "least-connections"));
+      cJSON* endpoints = cJSON_CreateArray();
+      for (auto ep = it->second->endpoints.begin(); ep != it->second->endpoints.end(); ++ep) {
+        cJSON* jsonEndpoint = cJSON_CreateObject();
+        cJSON_AddItemToObject(jsonEndpoint, "url", cJSON_CreateString((*ep)->url.c_str()));
+        cJSON_AddItemToObject(jsonEndpoint, "healthy", cJSON_CreateBool(endpointHealthy(ep->get(), now)));
+        cJSON_AddItemToObject(jsonEndpoint, "activeCalls", cJSON_CreateNumber((*ep)->active.load(std::memory_order_relaxed)));
+        cJSON_AddItemToObject(jsonEndpoint, "failures", cJSON_CreateNumber((*ep)->failures.load(std::memory_order_relaxed)));
+        cJSON_AddItemToArray(endpoints, jsonEndpoint);
+      }
+      cJSON_AddItemToObject(jsonGroup, "destinations", endpoints);
+      cJSON_AddItemToArray(jsonGroups, jsonGroup);
+    }
+    cJSON_AddItemToObject(json, "groups", jsonGroups);
+
+    char* text = cJSON_Print(json);
+    cJSON_Delete(json);
+    return text;
   }
 
   switch_bool_t fork_frame(switch_core_session_t *session, switch_media_bug_t *bug) {
     private_t* tech_pvt = (private_t*) switch_core_media_bug_get_user_data(bug);
-    size_t inuse = 0;
-    bool dirty = false;
 
-    if (!tech_pvt || !tech_pvt->wsi) return SWITCH_FALSE;
-    
-    if (switch_mutex_trylock(tech_pvt->mutex) == SWITCH_STATUS_SUCCESS) {
-      size_t available = tech_pvt->ws_audio_buffer_max_len - tech_pvt->ws_audio_buffer_write_offset;
-      if (tech_pvt->ws_state != LWS_CLIENT_CONNECTED) {
-        switch_mutex_unlock(tech_pvt->mutex);
-        return SWITCH_TRUE;
-      }
-      else if (available < tech_pvt->ws_audio_buffer_min_freespace) {
-        switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR, "(%u) dropping packets! write offset %lu available %lu\n", 
-          tech_pvt->id, tech_pvt->ws_audio_buffer_write_offset, available);
-      }
-      else if (NULL == tech_pvt->resampler) {
-        switch_frame_t frame = { 0 };
-        frame.data = (char *) tech_pvt->ws_audio_buffer + tech_pvt->ws_audio_buffer_write_offset;
-        frame.buflen = available;
-        while (switch_core_media_bug_read(bug, &frame, SWITCH_TRUE) == SWITCH_STATUS_SUCCESS) {
-          if (frame.datalen) {
-            tech_pvt->ws_audio_buffer_write_offset += frame.datalen;
-            available -= frame.datalen;
-            frame.data = (char *) tech_pvt->ws_audio_buffer + tech_pvt->ws_audio_buffer_write_offset;
-            frame.buflen = available;
-            dirty = true;
-            switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_DEBUG, "(%u) (rtpthread) wrote %u bytes, write offset now %lu available %lu\n", 
-              tech_pvt->id, frame.datalen, tech_pvt->ws_audio_buffer_write_offset, available);
-          }
-          else {
-            switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR, "(%u) dropped packet! write offset %lu available %lu\n", 
-              tech_pvt->id, tech_pvt->ws_audio_buffer_write_offset, available);
-            break;
-          }
-        }
+    if (!tech_pvt) return SWITCH_FALSE;
+
+    // audio is buffered while an asynchronous connect is still in progress
+    int state = captureState(tech_pvt);
+    if (state < 0) return SWITCH_FALSE;
+    if (state == 0) return SWITCH_TRUE;
+
+    // audio is captured once for all destinations, and nothing here ever waits on, or wakes, an lws thread
+    uint8_t data[SWITCH_RECOMMENDED_BUFFER_SIZE];
+    spx_int16_t resampled[SWITCH_RECOMMENDED_BUFFER_SIZE];
+    switch_frame_t frame = { 0 };
+    frame.data = data;
+    frame.buflen = SWITCH_RECOMMENDED_BUFFER_SIZE;
+
+    drachtio::AudioEncoder* encoder = static_cast<drachtio::AudioEncoder*>(tech_pvt->encoder);
+    // packets are stamped with the capture time of the audio being stored, which for held preroll is in the past
+    int64_t captured = 0;
+    drachtio::AudioEncoder::PacketWriter writer = [tech_pvt, &captured](const uint8_t* data, size_t len, uint32_t samples) {
+      return writePacket(tech_pvt, data, len, samples, captured);
+    };
+    drachtio::EnergyVad::Sink store = [tech_pvt, encoder, &writer, &captured](const uint8_t* data, size_t len, uint32_t samples, int64_t when) {
+      captured = when;
+      return encoder ? encoder->encode((const int16_t *) data, samples, writer) : writePacket(tech_pvt, data, len, samples, when);
+    };
+
+    while (switch_core_media_bug_read(bug, &frame, SWITCH_TRUE) == SWITCH_STATUS_SUCCESS) {
+      if (!frame.datalen) break;
+      bump(statsOf(tech_pvt)->framesCaptured, 1);
+      bump(totals.framesCaptured, 1);
+
+      const int16_t* audio = (const int16_t *) frame.data;
+      uint32_t samples = frame.datalen / (sizeof(int16_t) * tech_pvt->channels);
+
+      if (tech_pvt->resampler) {
+        spx_uint32_t out_len = SWITCH_RECOMMENDED_BUFFER_SIZE / tech_pvt->channels;  // samples per channel
+        spx_uint32_t in_len = samples;
+
+        speex_resampler_process_interleaved_int(tech_pvt->resampler, 
+          (const spx_int16_t *) frame.data, 
+          (spx_uint32_t *) &in_len, 
+          resampled,
+          &out_len);
+
+        audio = resampled;
+        samples = out_len;
+        if (0 == samples) continue;
+      }
+
+      // silence is held back rather than forked when voice activity detection is on
+      const size_t len = samples * sizeof(int16_t) * tech_pvt->channels;
+      const int64_t now = switch_micro_time_now();
+      if (tech_pvt->vad && !gateSpeech(tech_pvt, audio, samples * tech_pvt->channels, (const uint8_t *) audio, len, samples, now, store)) continue;
+
+      if (store((const uint8_t *) audio, len, samples, now)) {
+        FORK_TRACE(TRACE_CAPTURED, tech_pvt->id, samples, len);
       }
       else {
-        uint8_t data[SWITCH_RECOMMENDED_BUFFER_SIZE];
-        switch_frame_t frame = { 0 };
-        frame.data = data;
-        frame.buflen = SWITCH_RECOMMENDED_BUFFER_SIZE;
-        while (switch_core_media_bug_read(bug, &frame, SWITCH_TRUE) == SWITCH_STATUS_SUCCESS) {
-          if (frame.datalen) {
-            spx_uint32_t out_len = available >> 1;  // space for samples which are 2 bytes
-            spx_uint32_t in_len = frame.samples;
-
-            speex_resampler_process_interleaved_int(tech_pvt->resampler, 
-              (const spx_int16_t *) frame.data, 
-              (spx_uint32_t *) &in_len, 
-              (spx_int16_t *) ((char *) tech_pvt->ws_audio_buffer + tech_pvt->ws_audio_buffer_write_offset),
-              &out_len);
-
-            if (out_len > 0) {
-              // bytes written = num samples * 2 * num channels
-              size_t bytes_written = out_len << tech_pvt->channels;
-              tech_pvt->ws_audio_buffer_write_offset += bytes_written ;
-              available -= bytes_written;
-              dirty = true;
-              switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_DEBUG, "(%u) (rtpthread) wrote %lu bytes, write offset now %lu available %lu\n", 
-                tech_pvt->id, bytes_written, tech_pvt->ws_audio_buffer_write_offset, available);
-            }
-            if (available < tech_pvt->ws_audio_buffer_min_freespace) {
-              switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR, "(%u) dropping packet! write offset %lu available %lu\n", 
-                tech_pvt->id, tech_pvt->ws_audio_buffer_write_offset, available);
-              break;
-            }
-          }
-        }
+        captureDropped(session, tech_pvt, samples, len);
       }
+    }
+
+    // nothing to signal: the service thread picks the audio up on its next flush
+    return SWITCH_TRUE;
+  }
+
+  switch_bool_t fork_frame_native(switch_core_session_t *session, switch_media_bug_t *bug) {
+    private_t* tech_pvt = (private_t*) switch_core_media_bug_get_user_data(bug);
+
+    if (!tech_pvt) return SWITCH_FALSE;
+
+    int state = captureState(tech_pvt);
+    if (state < 0) return SWITCH_FALSE;
+    if (state == 0) return SWITCH_TRUE;
+
+    // the channel is already speaking the G.711 flavour we were asked for, so its payload is forked as is
+    switch_frame_t* frame = switch_core_media_bug_get_native_read_frame(bug);
+    if (!frame || !frame->datalen || (frame->flags & SFF_CNG)) return SWITCH_TRUE;
+    const int64_t now = switch_micro_time_now();
+    bump(statsOf(tech_pvt)->framesCaptured, 1);
+    bump(totals.framesCaptured, 1);
+
+    // a re-invite may have moved the channel to another codec; never fork bytes the far end can't decode
+    const char* expected = AUDIO_FORK_CODEC_PCMA == tech_pvt->codec ? "PCMA" : "PCMU";
+    if (!frame->codec || !frame->codec->implementation || strcasecmp(frame->codec->implementation->iananame, expected)) {
+      return SWITCH_TRUE;
+    }
 
-      if (dirty) {
-        addPendingWrite(tech_pvt);
-        lws_cancel_service(tech_pvt->vhd->context);
+    if (tech_pvt->vad) {
+      // the detector needs linear audio, the far end still gets the channel's own payload
+      int16_t pcm[SWITCH_RECOMMENDED_BUFFER_SIZE];
+      const uint8_t* payload = (const uint8_t *) frame->data;
+      size_t count = std::min((size_t) frame->datalen, (size_t) SWITCH_RECOMMENDED_BUFFER_SIZE);
+      for (size_t i = 0; i < count; i++) {
+        pcm[i] = AUDIO_FORK_CODEC_PCMA == tech_pvt->codec ? drachtio::alaw_to_linear(payload[i]) : drachtio::ulaw_to_linear(payload[i]);
       }
-      switch_mutex_unlock(tech_pvt->mutex);
+      drachtio::EnergyVad::Sink store = [tech_pvt](const uint8_t* data, size_t len, uint32_t samples, int64_t captured) {
+        return writePacket(tech_pvt, data, len, samples, captured);
+      };
+      if (!gateSpeech(tech_pvt, pcm, count, payload, frame->datalen, frame->datalen, now, store)) return SWITCH_TRUE;
+    }
+
+    if (writePacket(tech_pvt, (const uint8_t *) frame->data, frame->datalen, frame->datalen, now)) {
+      FORK_TRACE(TRACE_CAPTURED, tech_pvt->id, frame->datalen, frame->datalen);
+    }
+    else {
+      captureDropped(session, tech_pvt, frame->datalen, frame->datalen);
+    }
+    return SWITCH_TRUE;
+  }
+
+  switch_bool_t fork_frame_playback(switch_core_session_t *session, switch_media_bug_t *bug) {
+    private_t* tech_pvt = (private_t*) switch_core_media_bug_get_user_data(bug);
+
+    if (!tech_pvt || !tech_pvt->playback) return SWITCH_TRUE;
+
+    // when nothing has been streamed to us the channel's own audio goes out untouched
+    drachtio::PlaybackBuffer* playback = static_cast<drachtio::PlaybackBuffer*>(tech_pvt->playback);
+    switch_frame_t* frame = switch_core_media_bug_get_write_replace_frame(bug);
+    if (frame && frame->data && frame->samples && playback->read((int16_t *) frame->data, frame->samples)) {
+      frame->datalen = frame->samples * sizeof(int16_t);
+      switch_core_media_bug_set_write_replace_frame(bug, frame);
     }
     return SWITCH_TRUE;
   }
 
+  /**
+   * MOD_AUDIO_FORK_SERVICE_THREAD_AFFINITY is either "true", pinning service thread n to cpu n, or a
+   * list of cpus and ranges (e.g. "2-5,8") that the threads are pinned to in turn.  Returns -1 if the
+   * thread should not be pinned.
+   */
+  int serviceThreadCpu(unsigned int nServiceThread) {
+    if (!requestedAffinity || switch_false(requestedAffinity)) return -1;
+    if (switch_true(requestedAffinity)) return nServiceThread % nCores;
+
+    std::vector<int> cpus;
+    std::string list(requestedAffinity);
+    size_t start = 0;
+    while (start < list.size()) {
+      size_t end = list.find(',', start);
+      if (end == std::string::npos) end = list.size();
+      std::string item = list.substr(start, end - start);
+      int first = 0, last = 0;
+      int n = sscanf(item.c_str(), "%d-%d", &first, &last);
+      if (n == 1) last = first;
+      if (n >= 1 && first >= 0 && last >= first) {
+        for (int cpu = first; cpu <= last && cpus.size() < 1024; cpu++) cpus.push_back(cpu);
+      }
+      start = end + 1;
+    }
+    return cpus.empty() ? -1 : cpus[nServiceThread % cpus.size()];
+  }
+
+  void pinServiceThread(unsigned int nServiceThread) {
+    int cpu = serviceThreadCpu(nServiceThread);
+    if (cpu < 0) return;
+#if defined(__linux__)
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    CPU_SET(cpu, &cpuset);
+    int err = pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset);
+    if (0 != err) {
+      switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "mod_audio_fork: failed pinning service thread %u to cpu %d: %s\n", 
+        nServiceThread, cpu, strerror(err));
+      return;
+    }
+    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "mod_audio_fork: service thread %u pinned to cpu %d\n", nServiceThread, cpu);
+#else
+    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "mod_audio_fork: service thread affinity is not supported on this platform\n");
+#endif
+  }
+
+  /* every service thread keeps its own pool for each prewarmed url, since a connection belongs to one context */
+  void buildPools(service_ctx* ctx) {
+    if (!requestedPrewarmUrls) return;
+    std::string urls(requestedPrewarmUrls);
+    size_t start = 0;
+    while (start < urls.size()) {
+      size_t end = urls.find(',', start);
+      if (end == std::string::npos) end = urls.size();
+      std::string url = urls.substr(start, end - start);
+      start = end + 1;
+
+      warm_pool pool;
+      pool.connecting = 0;
+      pool.starting = pool.startFailed = false;
+      pool.retryAt = 0;
+      if (url.empty() || !parse_ws_uri(url.c_str(), pool.host, pool.path, &pool.port, &pool.sslFlags)) {
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "mod_audio_fork: invalid prewarm url '%s'\n", url.c_str());
+        continue;
+      }
+      pool.key = connectionKey(pool.host, pool.port, pool.path, pool.sslFlags);
+      ctx->pools.push_back(pool);
+    }
+  }
+
+  /* one service thread is plenty to run the active health checks for every group */
+  void buildProbes(service_ctx* ctx) {
+    if (!nHealthCheckIntervalMs) return;
+    for (auto it = groups.begin(); it != groups.end(); ++it) {
+      for (auto ep = it->second->endpoints.begin(); ep != it->second->endpoints.end(); ++ep) {
+        health_probe probe = { ep->get(), false, false, false, 0 };
+        ctx->probes.push_back(probe);
+      }
+    }
+  }
+
   void service_thread(unsigned int nServiceThread, int *pRunning) {
     struct lws_context_creation_info info;
 
+    pinServiceThread(nServiceThread);
+    buildPools(&services[nServiceThread]);
+    if (0 == nServiceThread) buildProbes(&services[nServiceThread]);
+
     memset(&info, 0, sizeof info); 
     info.port = CONTEXT_PORT_NO_LISTEN; 
     info.protocols = protocols;
     info.options = LWS_SERVER_OPTION_DO_SSL_GLOBAL_INIT;
+#if defined(LWS_WITH_TLS_SESSIONS)
+    // client sessions are cached per vhost, i.e. per service thread, and resumed on the next connect to the same server
+    info.tls_session_cache_max = nTlsSessions;
+#else
+    if (requestedTlsSessions) {
+      switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "mod_audio_fork: libwebsockets was built without LWS_WITH_TLS_SESSIONS, tls sessions will not be resumed\n");
+    }
+#endif
+    info.user = &services[nServiceThread];
 
-    context[nServiceThread] = lws_create_context(&info);
-    if (!context[nServiceThread]) {
+    struct lws_context *context = lws_create_context(&info);
+    if (!context) {
       switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "mod_audio_fork: lws_create_context failed\n");
       return;
     }
-    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "mod_audio_fork: successfully created lws context in thread %lu\n", 
-      switch_thread_self());
+    service_ctx* ctx = &services[nServiceThread];
+    ctx->context = context;
+    ctx->nextFlush = switch_micro_time_now() + nFlushIntervalMs * 1000;
+    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "mod_audio_fork: successfully created lws context in thread %lu, flushing every %d ms\n", 
+      switch_thread_self(), nFlushIntervalMs);
+
+#if LWS_LIBRARY_VERSION_MAJOR >= 4
+    // lws 4 ignores the service timeout, so the flush tick has to be an lws timer
+    ctx->timer.ctx = ctx;
+    lws_sul_schedule(context, 0, &ctx->timer.sul, flush_timer_cb, nFlushIntervalMs * 1000);
+#endif
 
     int n;
     do {
-      n = lws_service(context[nServiceThread], WS_TIMEOUT_MS);
-    } while (n >= 0 && *pRunning);
-
-    lws_context_destroy(context[nServiceThread]);
+      int timeout = WS_TIMEOUT_MS;
+#if LWS_LIBRARY_VERSION_MAJOR < 4
+      switch_time_t now = switch_micro_time_now();
+      if (now >= ctx->nextFlush) flushConnections(ctx);
+      timeout = std::max(1, std::min(timeout, (int) ((ctx->nextFlush - now) / 1000)));
+#endif
+      n = lws_service(context, timeout);
+    } while (n >= 0 && *pRunning && !stopServices);
+
+    services[nServiceThread].context = NULL;
+    lws_context_destroy(context);
   }
 
   switch_status_t fork_service_threads(int *pRunning) {
@@ -873,9 +3297,15 @@ extern "C" {
     lws_set_log_level(logs, lws_logger);
 
     switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "mod_audio_fork: starting %u service threads\n", nServiceThreads);
+    std::lock_guard<std::mutex> lk(serviceThreadsMutex);
     for (unsigned int i = 0; i < nServiceThreads; i++) {
-      std::thread t(service_thread, i, pRunning);
-      t.detach();
+      nRunningServiceThreads++;
+      serviceThreads.emplace_back([i, pRunning] {
+        service_thread(i, pRunning);
+        std::lock_guard<std::mutex> lk(serviceThreadsMutex);
+        nRunningServiceThreads--;
+        serviceThreadsExited.notify_all();
+      });
     }
 
 
@@ -7,10 +7,21 @@ int parse_ws_uri(const char* szServerUri, char* host, char *path, unsigned int*
 
 switch_status_t fork_init();
 switch_status_t fork_cleanup();
+void fork_drain(int enable);
+void fork_trace(int enable);
+char* fork_trace_dump(void);
 switch_status_t fork_session_init(switch_core_session_t *session, responseHandler_t responseHandler,
-		uint32_t samples_per_second, char *host, unsigned int port, char* path, int sampling, int sslFlags, int channels, char* metadata, void **ppUserData);
+		uint32_t samples_per_second, char *host, unsigned int port, char* path, char* group, int sampling, int codec, int sslFlags, int channels, char* metadata, void **ppUserData);
+switch_status_t fork_session_add_destination(switch_core_session_t *session, void *pUserData,
+		char *host, unsigned int port, char* path, char* group, int sslFlags, char* metadata);
 switch_status_t fork_session_cleanup(switch_core_session_t *session, char* text);
+switch_status_t fork_session_stop(switch_core_session_t *session, char* text);
+void fork_session_release(void *pUserData);
 switch_status_t fork_session_send_text(switch_core_session_t *session, char* text);
+char* fork_session_stats(switch_core_session_t *session);
+char* fork_module_stats(void);
 switch_bool_t fork_frame(switch_core_session_t *session, switch_media_bug_t *bug);
+switch_bool_t fork_frame_native(switch_core_session_t *session, switch_media_bug_t *bug);
+switch_bool_t fork_frame_playback(switch_core_session_t *session, switch_media_bug_t *bug);
 switch_status_t fork_service_threads();
 #endif
@@ -41,6 +41,7 @@ static switch_bool_t capture_callback(switch_media_bug_t *bug, void *user_data,
 		{
 			switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "Got SWITCH_ABC_TYPE_CLOSE.\n");
       fork_session_cleanup(session, NULL);
+      fork_session_release(user_data);
 		}
 		break;
 	
@@ -48,6 +49,14 @@ static switch_bool_t capture_callback(switch_media_bug_t *bug, void *user_data,
 		return fork_frame(session, bug);
 		break;
 
+	case SWITCH_ABC_TYPE_TAP_NATIVE_READ:
+		return fork_frame_native(session, bug);
+		break;
+
+	case SWITCH_ABC_TYPE_WRITE_REPLACE:
+		return fork_frame_playback(session, bug);
+		break;
+
 	case SWITCH_ABC_TYPE_WRITE:
 	default:
 		break;
@@ -56,13 +65,26 @@ static switch_bool_t capture_callback(switch_media_bug_t *bug, void *user_data,
 	return SWITCH_TRUE;
 }
 
+/* a destination is either a websocket url or "group:<name>", one of the groups in audio_fork.conf */
+static int parse_destination(char* url, char* host, char* path, unsigned int* pPort, int* pSslFlags, char** pGroup)
+{
+	if (!strncasecmp(url, "group:", 6) && url[6]) {
+		*pGroup = url + 6;
+		*host = *path = '\0';
+		*pPort = 0;
+		*pSslFlags = 0;
+		return 1;
+	}
+	*pGroup = NULL;
+	return parse_ws_uri(url, host, path, pPort, pSslFlags);
+}
+
 static switch_status_t start_capture(switch_core_session_t *session, 
         switch_media_bug_flag_t flags, 
-        char* host,
-        unsigned int port, 
-        char* path,
+        char** urls,
+        int nUrls,
         int sampling,
-        int sslFlags,
+        int codec,
 	      char* metadata, 
         const char* base)
 {
@@ -70,13 +92,29 @@ static switch_status_t start_capture(switch_core_session_t *session,
 	switch_media_bug_t *bug;
 	switch_status_t status;
 	switch_codec_t* read_codec;
+	char host[MAX_WS_URL_LEN], path[MAX_PATH_LEN];
+	unsigned int port;
+	int sslFlags;
+	char* group;
+	int i;
 
 	void *pUserData = NULL;
   int channels = (flags & SMBF_STEREO) ? 2 : 1;
 
-	switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, 
-    "mod_audio_fork: streaming %d sampling to %s path %s port %d tls: %s.\n", 
-    sampling, host, path, port, sslFlags ? "yes" : "no");
+	if (!parse_destination(urls[0], &host[0], &path[0], &port, &sslFlags, &group)) {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "mod_audio_fork: invalid websocket uri: %s\n", urls[0]);
+		return SWITCH_STATUS_FALSE;
+	}
+
+	if (group) {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, 
+			"mod_audio_fork: streaming %d sampling (codec %d) to destination group %s.\n", sampling, codec, group);
+	}
+	else {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, 
+			"mod_audio_fork: streaming %d sampling (codec %d) to %s path %s port %d tls: %s.\n", 
+			sampling, codec, host, path, port, sslFlags ? "yes" : "no");
+	}
 
 	if (switch_channel_get_private(channel, MY_BUG_NAME)) {
 		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "mod_audio_fork: bug already attached!\n");
@@ -85,16 +123,40 @@ static switch_status_t start_capture(switch_core_session_t *session,
 
 	read_codec = switch_core_session_get_read_codec(session);
 
+	/* a mono G.711 fork of a channel already using that codec taps the encoded payload: no decode, no resample */
+	if ((codec == AUDIO_FORK_CODEC_PCMU || codec == AUDIO_FORK_CODEC_PCMA) && !(flags & SMBF_WRITE_STREAM) &&
+		read_codec && read_codec->implementation && 8000 == read_codec->implementation->actual_samples_per_second &&
+		!strcasecmp(read_codec->implementation->iananame, codec == AUDIO_FORK_CODEC_PCMA ? "PCMA" : "PCMU")) {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "mod_audio_fork: forking native %s payload.\n", read_codec->implementation->iananame);
+		flags = (flags & ~SMBF_READ_STREAM) | SMBF_TAP_NATIVE_READ;
+	}
+
 	if (switch_channel_pre_answer(channel) != SWITCH_STATUS_SUCCESS) {
 		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "mod_audio_fork: channel must have reached pre-answer status before calling start!\n");
 		return SWITCH_STATUS_FALSE;
 	}
 
 	if (SWITCH_STATUS_FALSE == fork_session_init(session, responseHandler, read_codec->implementation->actual_samples_per_second, 
-		host, port, path, sampling, sslFlags, channels, metadata, &pUserData)) {
+		host, port, path, group, sampling, codec, sslFlags, channels, metadata, &pUserData)) {
 		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Error initializing mod_audio_fork session.\n");
 		return SWITCH_STATUS_FALSE;
 	}
+
+	/* additional destinations share the capture; one that can't be reached doesn't stop the others */
+	for (i = 1; i < nUrls; i++) {
+		if (!parse_destination(urls[i], &host[0], &path[0], &port, &sslFlags, &group)) {
+			switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "mod_audio_fork: invalid websocket uri: %s\n", urls[i]);
+			continue;
+		}
+		if (group) switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "mod_audio_fork: also streaming to destination group %s.\n", group);
+		else switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "mod_audio_fork: also streaming to %s path %s port %d tls: %s.\n", 
+			host, path, port, sslFlags ? "yes" : "no");
+		fork_session_add_destination(session, pUserData, host, port, path, group, sslFlags, metadata);
+	}
+
+	if (((private_t *) pUserData)->playback) {
+		flags |= SMBF_WRITE_REPLACE;
+	}
 	if ((status = switch_core_media_bug_add(session, MY_BUG_NAME, NULL, capture_callback, pUserData, 0, flags, &bug)) != SWITCH_STATUS_SUCCESS) {
 		return status;
 	}
@@ -114,7 +176,7 @@ static switch_status_t do_stop(switch_core_session_t *session, char* text)
 	else {
 		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "mod_audio_fork: stop\n");
 	}
-	status = fork_session_cleanup(session, text);
+	status = fork_session_stop(session, text);
 
 	return status;
 }
@@ -135,7 +197,19 @@ static switch_status_t send_text(switch_core_session_t *session, char* text) {
   return status;
 }
 
-#define FORK_API_SYNTAX "<uuid> [start | stop | send_text] [wss-url | path] [mono | mixed | stereo] [8k | 16k] [metadata]"
+static switch_status_t session_stats(switch_core_session_t *session, switch_stream_handle_t *stream) {
+	char *json = fork_session_stats(session);
+
+	if (!json) {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "mod_audio_fork: no bug, no stats.\n");
+		return SWITCH_STATUS_FALSE;
+	}
+	stream->write_function(stream, "%s\n", json);
+	free(json);
+	return SWITCH_STATUS_SUCCESS;
+}
+
+#define FORK_API_SYNTAX "<uuid> [start | stop | send_text | stats] [wss-url | group:name[,...]] [mono | mixed | stereo] [8k | 16k][:l16 | :opus | :flac | :ulaw | :alaw] [metadata]"
 SWITCH_STANDARD_API(fork_function)
 {
 	char *mycmd = NULL, *argv[6] = { 0 };
@@ -165,11 +239,20 @@ SWITCH_STANDARD_API(fork_function)
         }
         status = send_text(lsession, argv[2]);
       }
+      else if (!strcasecmp(argv[1], "stats")) {
+        /* the stats are the response */
+        if (SWITCH_STATUS_SUCCESS != session_stats(lsession, stream)) {
+          stream->write_function(stream, "-ERR Operation Failed\n");
+        }
+        switch_core_session_rwunlock(lsession);
+        goto done;
+      }
       else if (!strcasecmp(argv[1], "start")) {
-        char host[MAX_WS_URL_LEN], path[MAX_PATH_LEN];
-        unsigned int port;
-        int sslFlags;
+        char *urls[MAX_DESTINATIONS] = { 0 };
+        int nUrls = switch_separate_string(argv[2], ',', urls, MAX_DESTINATIONS);
         int sampling = 8000;
+        int codec = AUDIO_FORK_CODEC_L16;
+        char *codecName = argv[4] ? strchr(argv[4], ':') : NULL;
       	switch_media_bug_flag_t flags = SMBF_READ_STREAM ;
         char *metadata = argc > 5 ? argv[5] : NULL ;
         if (0 == strcmp(argv[3], "mixed")) {
@@ -184,20 +267,43 @@ SWITCH_STANDARD_API(fork_function)
           switch_core_session_rwunlock(lsession);
           goto done;
         }
+        if (codecName) {
+          *codecName++ = '\0';
+          if (0 == strcasecmp(codecName, "opus")) codec = AUDIO_FORK_CODEC_OPUS;
+          else if (0 == strcasecmp(codecName, "flac")) codec = AUDIO_FORK_CODEC_FLAC;
+          else if (0 == strcasecmp(codecName, "ulaw")) codec = AUDIO_FORK_CODEC_PCMU;
+          else if (0 == strcasecmp(codecName, "alaw")) codec = AUDIO_FORK_CODEC_PCMA;
+          else if (0 != strcasecmp(codecName, "l16")) {
+            switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR, "invalid codec: %s, must be l16, opus, flac, ulaw or alaw\n", codecName);
+            switch_core_session_rwunlock(lsession);
+            goto done;
+          }
+        }
         if (0 == strcmp(argv[4], "16k")) {
           sampling = 16000;
+        }
+        else if (0 == strcmp(argv[4], "8k")) {
+          sampling = 8000;
+        }
+        else if (0 == strcasecmp(argv[4], "ulaw") || 0 == strcasecmp(argv[4], "alaw")) {
+          // shorthand for 8k:ulaw / 8k:alaw
+          codec = 0 == strcasecmp(argv[4], "ulaw") ? AUDIO_FORK_CODEC_PCMU : AUDIO_FORK_CODEC_PCMA;
+          sampling = 8000;
         }
 				else {
 					sampling = atoi(argv[4]);
 				}
-        if (!parse_ws_uri(argv[2], &host[0], &path[0], &port, &sslFlags)) {
+        if (nUrls < 1 || zstr(urls[0])) {
           switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR, "invalid websocket uri: %s\n", argv[2]);
         }
 				else if (sampling % 8000 != 0) {
           switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR, "invalid sample rate: %s\n", argv[4]);					
 				}
+        else if ((codec == AUDIO_FORK_CODEC_PCMU || codec == AUDIO_FORK_CODEC_PCMA) && sampling != 8000) {
+          switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR, "ulaw and alaw require 8k sampling: %s\n", argv[4]);
+        }
         else {
-          status = start_capture(lsession, flags, host, port, path, sampling, sslFlags, metadata, "mod_audio_fork");
+          status = start_capture(lsession, flags, urls, nUrls, sampling, codec, metadata, "mod_audio_fork");
         }
 			}
       else {
@@ -222,6 +328,65 @@ SWITCH_STANDARD_API(fork_function)
 	return SWITCH_STATUS_SUCCESS;
 }
 
+#define FORK_STATS_API_SYNTAX ""
+SWITCH_STANDARD_API(fork_stats_function)
+{
+	char *json = fork_module_stats();
+
+	if (json) {
+		stream->write_function(stream, "%s\n", json);
+		free(json);
+	}
+	else {
+		stream->write_function(stream, "-ERR Operation Failed\n");
+	}
+	return SWITCH_STATUS_SUCCESS;
+}
+
+#define FORK_DRAIN_API_SYNTAX "[on | off]"
+SWITCH_STANDARD_API(fork_drain_function)
+{
+	if (zstr(cmd) || !strcasecmp(cmd, "on")) {
+		fork_drain(1);
+	}
+	else if (!strcasecmp(cmd, "off")) {
+		fork_drain(0);
+	}
+	else {
+		stream->write_function(stream, "-USAGE: %s\n", FORK_DRAIN_API_SYNTAX);
+		return SWITCH_STATUS_SUCCESS;
+	}
+	stream->write_function(stream, "+OK Success\n");
+	return SWITCH_STATUS_SUCCESS;
+}
+
+#define FORK_TRACE_API_SYNTAX "[on | off | dump]"
+SWITCH_STANDARD_API(fork_trace_function)
+{
+	if (zstr(cmd) || !strcasecmp(cmd, "dump")) {
+		char *text = fork_trace_dump();
+		if (text) {
+			stream->write_function(stream, "%s", text);
+			free(text);
+		}
+		else {
+			stream->write_function(stream, "-ERR Operation Failed\n");
+		}
+		return SWITCH_STATUS_SUCCESS;
+	}
+	if (!strcasecmp(cmd, "on")) {
+		fork_trace(1);
+	}
+	else if (!strcasecmp(cmd, "off")) {
+		fork_trace(0);
+	}
+	else {
+		stream->write_function(stream, "-USAGE: %s\n", FORK_TRACE_API_SYNTAX);
+		return SWITCH_STATUS_SUCCESS;
+	}
+	stream->write_function(stream, "+OK Success\n");
+	return SWITCH_STATUS_SUCCESS;
+}
 
 SWITCH_MODULE_LOAD_FUNCTION(mod_audio_fork_load)
 {
@@ -238,6 +403,8 @@ SWITCH_MODULE_LOAD_FUNCTION(mod_audio_fork_load)
     switch_event_reserve_subclass(EVENT_PLAY_AUDIO) != SWITCH_STATUS_SUCCESS ||
     switch_event_reserve_subclass(EVENT_KILL_AUDIO) != SWITCH_STATUS_SUCCESS ||
     switch_event_reserve_subclass(EVENT_ERROR) != SWITCH_STATUS_SUCCESS ||
+    switch_event_reserve_subclass(EVENT_CONNECT_SUCCESS) != SWITCH_STATUS_SUCCESS ||
+    switch_event_reserve_subclass(EVENT_CONNECT_FAIL) != SWITCH_STATUS_SUCCESS ||
     switch_event_reserve_subclass(EVENT_DISCONNECT) != SWITCH_STATUS_SUCCESS) {
 
 		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Couldn't register an event subclass for mod_audio_fork API.\n");
@@ -248,6 +415,15 @@ SWITCH_MODULE_LOAD_FUNCTION(mod_audio_fork_load)
 	switch_console_set_complete("add uuid_audio_fork start wss-url metadata");
 	switch_console_set_complete("add uuid_audio_fork start wss-url");
 	switch_console_set_complete("add uuid_audio_fork stop");
+	switch_console_set_complete("add uuid_audio_fork stats");
+	SWITCH_ADD_API(api_interface, "audio_fork_stats", "audio_fork module statistics", fork_stats_function, FORK_STATS_API_SYNTAX);
+	SWITCH_ADD_API(api_interface, "audio_fork_drain", "stop or resume accepting new audio forks", fork_drain_function, FORK_DRAIN_API_SYNTAX);
+	switch_console_set_complete("add audio_fork_drain on");
+	switch_console_set_complete("add audio_fork_drain off");
+	SWITCH_ADD_API(api_interface, "audio_fork_trace", "audio_fork hot path tracing", fork_trace_function, FORK_TRACE_API_SYNTAX);
+	switch_console_set_complete("add audio_fork_trace on");
+	switch_console_set_complete("add audio_fork_trace off");
+	switch_console_set_complete("add audio_fork_trace dump");
 
 	fork_init();
 
@@ -271,6 +447,8 @@ SWITCH_MODULE_SHUTDOWN_FUNCTION(mod_audio_fork_shutdown)
 	switch_event_free_subclass(EVENT_KILL_AUDIO);
 	switch_event_free_subclass(EVENT_DISCONNECT);
 	switch_event_free_subclass(EVENT_ERROR);
+	switch_event_free_subclass(EVENT_CONNECT_SUCCESS);
+	switch_event_free_subclass(EVENT_CONNECT_FAIL);
 
 	return SWITCH_STATUS_SUCCESS;
 }
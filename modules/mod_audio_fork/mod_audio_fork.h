@@ -11,6 +11,7 @@
 #define MAX_SESSION_ID (256)
 #define MAX_WS_URL_LEN (512)
 #define MAX_PATH_LEN (128)
+#define MAX_DESTINATIONS (4)
 
 #define EVENT_TRANSCRIPTION   "mod_audio_fork::transcription"
 #define EVENT_TRANSFER        "mod_audio_fork::transfer"
@@ -18,6 +19,16 @@
 #define EVENT_KILL_AUDIO      "mod_audio_fork::kill_audio"
 #define EVENT_DISCONNECT      "mod_audio_fork::disconnect"
 #define EVENT_ERROR           "mod_audio_fork::error"
+#define EVENT_CONNECT_SUCCESS "mod_audio_fork::connect"
+#define EVENT_CONNECT_FAIL    "mod_audio_fork::connect_failed"
+
+enum {
+	AUDIO_FORK_CODEC_L16,
+	AUDIO_FORK_CODEC_OPUS,
+	AUDIO_FORK_CODEC_FLAC,
+	AUDIO_FORK_CODEC_PCMU,
+	AUDIO_FORK_CODEC_PCMA
+};
 
 enum {
 	LWS_CLIENT_IDLE,
@@ -43,7 +54,6 @@ typedef void (*responseHandler_t)(const char* sessionId, const char* eventName,
 
 struct private_data {
 	switch_mutex_t *mutex;
-	switch_mutex_t *ws_send_mutex;
 	switch_mutex_t *ws_recv_mutex;
   switch_thread_cond_t *cond;
 	char sessionId[MAX_SESSION_ID];
@@ -53,21 +63,51 @@ struct private_data {
   char host[MAX_WS_URL_LEN];
   unsigned int port;
   char path[MAX_PATH_LEN];
-  uint8_t *metadata;
-  size_t metadata_length;
+  void *text_fifo;
+  int text_turn;
   int sslFlags;
   int sampling;
+  int codec;
+  void *encoder;
+  int message_per_packet;
+  void *playback;
   struct lws *wsi;
-  uint8_t *ws_audio_buffer;
-  size_t ws_audio_buffer_max_len;
-  size_t ws_audio_buffer_write_offset;
-  size_t ws_audio_buffer_min_freespace;
+  void *audio_ring;
+  struct private_data *capture;
+  struct private_data *next_destination;
+  size_t audio_cursor;
+  int multiplexed;
+  void *mux;
+  int max_reconnects;
+  int reconnects;
+  int reconnecting;
+  uint8_t *stream_header;
+  size_t stream_header_len;
+  int resend_header;
+  size_t drop_from;
+  int drop_pending;
+  void *stats;
+  int framing;
+  uint32_t sequence;
+  uint32_t frame_samples;
+  void *vad;
+  uint8_t *ws_send_buffer;
+  size_t ws_send_buffer_len;
   uint8_t* recv_buf;
   uint8_t* recv_buf_ptr;
+  size_t recv_buf_len;
   struct playout* playout;
+  int pending_playouts;
   struct lws_per_vhost_data* vhd;
   int  channels;
   unsigned int id;
+  unsigned int service_thread;
+  int service_assigned;
+  void *endpoint;
+  uint32_t endpoints_tried;
+  char* final_text;
+  switch_time_t drop_logged;          /* by the service thread */
+  switch_time_t capture_drop_logged;  /* by the media thread */
 };
 
 typedef struct private_data private_t;
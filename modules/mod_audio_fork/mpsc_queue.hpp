@@ -0,0 +1,63 @@
+#ifndef __MPSC_QUEUE_HPP__
+#define __MPSC_QUEUE_HPP__
+
+#include <algorithm>
+#include <atomic>
+#include <vector>
+
+namespace drachtio {
+
+/// Lock-free multiple producer / single consumer queue
+/**
+ * Any thread may push; only the owning lws service thread pops.  Producers link nodes
+ * onto a stack with a CAS, and the consumer detaches the whole stack in one exchange and
+ * reverses it, so items come out in the order they were pushed.  Because the consumer
+ * never removes individual nodes there is no ABA hazard.
+ */
+template<typename T>
+class MpscQueue {
+public:
+  MpscQueue() : m_head(nullptr) {}
+  ~MpscQueue() {
+    std::vector<T> items;
+    popAll(items);
+  }
+
+  /// producer: may be called from any thread
+  void push(const T& value) {
+    Node* node = new Node(value);
+    node->next = m_head.load(std::memory_order_relaxed);
+    while (!m_head.compare_exchange_weak(node->next, node, std::memory_order_release, std::memory_order_relaxed));
+  }
+
+  /// consumer: append everything queued so far to items, oldest first
+  void popAll(std::vector<T>& items) {
+    Node* node = m_head.exchange(nullptr, std::memory_order_acquire);
+    size_t first = items.size();
+    while (node) {
+      Node* next = node->next;
+      items.push_back(node->value);
+      delete node;
+      node = next;
+    }
+    std::reverse(items.begin() + first, items.end());
+  }
+
+  bool empty() const { return nullptr == m_head.load(std::memory_order_acquire); }
+
+private:
+  MpscQueue(const MpscQueue&);
+  MpscQueue& operator=(const MpscQueue&);
+
+  struct Node {
+    explicit Node(const T& v) : value(v), next(nullptr) {}
+    T value;
+    Node* next;
+  };
+
+  std::atomic<Node*> m_head;
+};
+
+} // namespace drachtio
+
+#endif // __MPSC_QUEUE_HPP__
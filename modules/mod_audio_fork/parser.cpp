@@ -2,19 +2,24 @@
 #include <switch.h>
 
 cJSON* parse_json(const char* sessionId, const std::string& data, std::string& type) {
+  return parse_json(sessionId, data.c_str(), type);
+}
+
+/* data must be null terminated; it is parsed where it lies */
+cJSON* parse_json(const char* sessionId, const char* data, std::string& type) {
   cJSON* json = NULL;
   const char *szType = NULL;
   switch_core_session_t* session = switch_core_session_locate(sessionId);
 	if (session) {
-    json = cJSON_Parse(data.c_str());
+    json = cJSON_Parse(data);
     if (!json) {
-      switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR, "parse - failed parsing json: %s\n", data.c_str());
+      switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR, "parse - failed parsing json: %s\n", data);
       goto done;
     }
 
     szType = cJSON_GetObjectCstr(json, "type");
     if (!szType) {
-      switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR, "parse - no type property found in: %s\n", data.c_str());
+      switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR, "parse - no type property found in: %s\n", data);
       cJSON_Delete(json);
       json = NULL;
       goto done;
@@ -5,5 +5,6 @@
 #include <switch_json.h>
 
 cJSON* parse_json(const char* sessionId, const std::string& data, std::string& type) ;
+cJSON* parse_json(const char* sessionId, const char* data, std::string& type) ;
 
 #endif
@@ -0,0 +1,168 @@
+#ifndef __PLAYBACK_BUFFER_HPP__
+#define __PLAYBACK_BUFFER_HPP__
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <speex/speex_resampler.h>
+
+#include "audio_ring.hpp"
+
+namespace drachtio {
+
+/// Jitter buffer for audio streamed back to the channel over the websocket
+/**
+ * The lws service thread writes L16 mono audio as it arrives in binary frames, resampling it
+ * to the rate of the channel's write codec, and the media thread pulls one frame at a time from
+ * the media bug's write-replace callback.  Playout only starts once a little audio has been
+ * buffered (or the far end has paused long enough that no more is coming), and restarts the
+ * same way after an underrun.
+ */
+class PlaybackBuffer {
+public:
+  PlaybackBuffer(uint32_t streamRate, uint32_t channelRate, size_t bufferMs, uint32_t prebufferMs) :
+    m_storage(channelRate * sizeof(int16_t) * bufferMs / 1000),
+    m_ring(&m_storage[0], m_storage.size()),
+    m_streamRate(streamRate),
+    m_channelRate(channelRate),
+    m_resampler(nullptr),
+    m_prebufferBytes(channelRate * sizeof(int16_t) * prebufferMs / 1000),
+    m_prebuffer(std::chrono::milliseconds(prebufferMs)),
+    m_haveOddByte(false),
+    m_oddByte(0),
+    m_lastWrite(0),
+    m_flush(false),
+    m_playing(false) {}
+
+  ~PlaybackBuffer() {
+    if (m_resampler) speex_resampler_destroy(m_resampler);
+  }
+
+  bool init(int quality, std::string& error) {
+    if (m_streamRate == m_channelRate) return true;
+    int err;
+    m_resampler = speex_resampler_init(1, m_streamRate, m_channelRate, quality, &err);
+    if (0 != err) {
+      error = speex_resampler_strerror(err);
+      return false;
+    }
+    return true;
+  }
+
+  /// producer: queue L16 audio received from the far end; returns false if some of it did not fit
+  bool write(const uint8_t* data, size_t len) {
+    bool ok = true;
+
+    // a sample may be split across two websocket messages
+    if (m_haveOddByte && len > 0) {
+      uint8_t bytes[2] = { m_oddByte, data[0] };
+      int16_t sample;
+      memcpy(&sample, bytes, sizeof(sample));
+      ok = store(&sample, 1);
+      m_haveOddByte = false;
+      data++;
+      len--;
+    }
+    if (len & 1) {
+      m_oddByte = data[len - 1];
+      m_haveOddByte = true;
+      len--;
+    }
+
+    // copy out so the samples are suitably aligned regardless of where the message landed
+    m_scratch.resize(len / sizeof(int16_t));
+    if (len) memcpy(&m_scratch[0], data, len);
+    if (!m_scratch.empty() && !store(&m_scratch[0], m_scratch.size())) ok = false;
+
+    m_lastWrite.store(now(), std::memory_order_release);
+    return ok;
+  }
+
+  /// producer: throw away anything queued, e.g. when the far end asks to kill audio
+  void flush() { m_flush.store(true, std::memory_order_release); }
+
+  /// consumer: fill a frame from the buffer; returns false if there is nothing to play yet
+  bool read(int16_t* out, uint32_t samples) {
+    if (m_flush.exchange(false, std::memory_order_acq_rel)) {
+      m_ring.discard(m_ring.size());
+      m_playing = false;
+    }
+
+    const size_t want = samples * sizeof(int16_t);
+    if (!m_playing) {
+      size_t buffered = m_ring.size();
+      if (0 == buffered) return false;
+      bool idle = now() - m_lastWrite.load(std::memory_order_acquire) >= m_prebuffer.count();
+      if (buffered < m_prebufferBytes && !idle) return false;
+      m_playing = true;
+    }
+
+    size_t n = m_ring.read(out, want);
+    if (n < want) {
+      memset(reinterpret_cast<uint8_t*>(out) + n, 0, want - n);
+      m_playing = false;
+    }
+    return true;
+  }
+
+  size_t buffered() const { return m_ring.size(); }
+
+private:
+  PlaybackBuffer(const PlaybackBuffer&);
+  PlaybackBuffer& operator=(const PlaybackBuffer&);
+
+  typedef std::chrono::steady_clock clock;
+
+  static clock::rep now() { return clock::now().time_since_epoch().count(); }
+
+  bool store(const int16_t* samples, size_t count) {
+    if (!m_resampler) return storeResampled(samples, count);
+
+    bool ok = true;
+    spx_int16_t out[960];
+    while (count > 0) {
+      spx_uint32_t in_len = count;
+      spx_uint32_t out_len = sizeof(out) / sizeof(out[0]);
+      speex_resampler_process_int(m_resampler, 0, samples, &in_len, out, &out_len);
+      if (out_len && !storeResampled(out, out_len)) ok = false;
+      samples += in_len;
+      count -= in_len;
+    }
+    return ok;
+  }
+
+  bool storeResampled(const int16_t* samples, size_t count) {
+    // only whole samples, and only as many as fit
+    size_t len = std::min(count * sizeof(int16_t), m_ring.freeSpace() & ~((size_t) 1));
+    if (len) m_ring.write(samples, len);
+    return len == count * sizeof(int16_t);
+  }
+
+  std::vector<uint8_t> m_storage;
+  AudioRing m_ring;
+  const uint32_t m_streamRate;
+  const uint32_t m_channelRate;
+  SpeexResamplerState* m_resampler;
+  const size_t m_prebufferBytes;
+  const clock::duration m_prebuffer;
+
+  // producer only
+  bool m_haveOddByte;
+  uint8_t m_oddByte;
+  std::vector<int16_t> m_scratch;
+
+  std::atomic<clock::rep> m_lastWrite;
+  std::atomic<bool> m_flush;
+
+  // consumer only
+  bool m_playing;
+};
+
+} // namespace drachtio
+
+#endif // __PLAYBACK_BUFFER_HPP__
@@ -0,0 +1,146 @@
+#ifndef __TRACE_RING_HPP__
+#define __TRACE_RING_HPP__
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace drachtio {
+
+/// One event recorded on a hot path: what happened, to which connection, and two values
+struct trace_entry {
+  int64_t when;       // microseconds since the epoch
+  uint32_t id;
+  uint32_t event;
+  uint64_t a;
+  uint64_t b;
+};
+
+/// Fixed size ring of trace entries, written by one thread and dumped from any other
+/**
+ * Recording is a handful of stores: nothing is formatted, allocated or locked.  When the ring is
+ * full the oldest entries are overwritten.  As in BroadcastRing, the writer announces the slot it
+ * is about to overwrite before touching it, so a dump taken while the thread is busy can tell
+ * which of the entries it copied were overwritten under it and leave them out.
+ */
+class TraceRing {
+public:
+  explicit TraceRing(size_t capacity) : m_entries(capacity), m_head(0), m_reserved(0) {}
+
+  size_t capacity() const { return m_entries.size(); }
+
+  void record(uint32_t event, uint32_t id, uint64_t a, uint64_t b) {
+    const uint64_t head = m_head.load(std::memory_order_relaxed);
+    m_reserved.store(head + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    trace_entry& e = m_entries[head % m_entries.size()];
+    e.when = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+    e.id = id;
+    e.event = event;
+    e.a = a;
+    e.b = b;
+    m_head.store(head + 1, std::memory_order_release);
+  }
+
+  /// append the entries currently in the ring to out, oldest first
+  void snapshot(std::vector<trace_entry>& out) const {
+    const uint64_t head = m_head.load(std::memory_order_acquire);
+    const uint64_t cap = m_entries.size();
+    uint64_t first = head > cap ? head - cap : 0;
+    std::vector<trace_entry> copy;
+    copy.reserve(head - first);
+    for (uint64_t i = first; i < head; i++) copy.push_back(m_entries[i % cap]);
+    std::atomic_thread_fence(std::memory_order_acquire);
+
+    // anything the writer may have started overwriting since is dropped
+    const uint64_t reserved = m_reserved.load(std::memory_order_relaxed);
+    uint64_t valid = reserved > cap ? reserved - cap : 0;
+    size_t skip = valid > first ? std::min<uint64_t>(valid - first, copy.size()) : 0;
+    out.insert(out.end(), copy.begin() + skip, copy.end());
+  }
+
+private:
+  TraceRing(const TraceRing&);
+  TraceRing& operator=(const TraceRing&);
+
+  std::vector<trace_entry> m_entries;
+  std::atomic<uint64_t> m_head;
+  std::atomic<uint64_t> m_reserved;
+};
+
+/// Per-thread trace rings, created the first time a thread records while tracing is on
+/**
+ * A thread's ring goes back on a free list when the thread exits, keeping its entries for the next
+ * dump until another thread takes it over, so there are never more rings than threads that have
+ * traced at the same time.  The runtime switch is a relaxed load on every call, which is all a
+ * hot path pays while tracing is off.
+ */
+class TraceLog {
+public:
+  static void configure(size_t capacity) {
+    std::lock_guard<std::mutex> lk(instance().m_mutex);
+    instance().m_capacity = std::max<size_t>(1, capacity);
+  }
+
+  static bool enabled() { return instance().m_enabled.load(std::memory_order_relaxed); }
+  static void enable(bool on) { instance().m_enabled.store(on, std::memory_order_relaxed); }
+
+  static void record(uint32_t event, uint32_t id, uint64_t a = 0, uint64_t b = 0) {
+    static thread_local holder mine;
+    if (!mine.ring) mine.ring = instance().acquire();
+    mine.ring->record(event, id, a, b);
+  }
+
+  /// every thread's entries, oldest first
+  static void snapshot(std::vector<trace_entry>& out) {
+    TraceLog& log = instance();
+    std::lock_guard<std::mutex> lk(log.m_mutex);
+    for (auto it = log.m_rings.begin(); it != log.m_rings.end(); ++it) (*it)->snapshot(out);
+    std::stable_sort(out.begin(), out.end(), [](const trace_entry& x, const trace_entry& y) { return x.when < y.when; });
+  }
+
+private:
+  struct holder {
+    TraceRing* ring = nullptr;
+    ~holder() { if (ring) instance().release(ring); }
+  };
+
+  TraceLog() : m_enabled(false), m_capacity(4096) {}
+
+  static TraceLog& instance() {
+    static TraceLog log;
+    return log;
+  }
+
+  TraceRing* acquire() {
+    std::lock_guard<std::mutex> lk(m_mutex);
+    if (!m_free.empty()) {
+      TraceRing* ring = m_free.back();
+      m_free.pop_back();
+      return ring;
+    }
+    m_rings.emplace_back(new TraceRing(m_capacity));
+    return m_rings.back().get();
+  }
+
+  void release(TraceRing* ring) {
+    std::lock_guard<std::mutex> lk(m_mutex);
+    m_free.push_back(ring);
+  }
+
+  std::atomic<bool> m_enabled;
+  std::mutex m_mutex;
+  size_t m_capacity;
+  std::vector<std::unique_ptr<TraceRing>> m_rings;
+  std::vector<TraceRing*> m_free;
+};
+
+} // namespace drachtio
+
+#endif // __TRACE_RING_HPP__
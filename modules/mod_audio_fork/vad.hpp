@@ -0,0 +1,143 @@
+#ifndef __VAD_HPP__
+#define __VAD_HPP__
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <vector>
+
+namespace drachtio {
+
+/// Energy based voice activity detector for the forked audio
+/**
+ * Runs on the media thread, one media bug frame at a time.  A frame whose level is at or above
+ * the threshold is speech; speech ends once the level has stayed below it for the hangover
+ * period, so short pauses between words don't chop the audio up.  While there is no speech the
+ * last few frames are held rather than forked, and are sent ahead of the speech that follows,
+ * since an energy detector only fires once the onset is already under way.
+ *
+ * The detector only looks at L16 audio, but it holds whatever payload the caller forks (L16
+ * or G.711), exactly as it would have been written to the ring.
+ */
+class EnergyVad {
+public:
+  enum Transition {
+    VAD_NONE,
+    VAD_SPEECH_START,
+    VAD_SPEECH_STOP
+  };
+
+  /// receives a held frame: its payload, the samples per channel it holds and when it was captured
+  typedef std::function<bool (const uint8_t* data, size_t len, uint32_t samples, int64_t captured)> Sink;
+
+  EnergyVad(uint32_t sampleRate, int thresholdDb, uint32_t hangoverMs, uint32_t prerollMs) :
+    m_threshold(std::pow(10.0, thresholdDb / 10.0) * 32768.0 * 32768.0),
+    m_hangoverSamples((uint64_t) sampleRate * hangoverMs / 1000),
+    m_prerollSamples((uint64_t) sampleRate * prerollMs / 1000),
+    m_speaking(false),
+    m_silentSamples(0),
+    m_heldSamples(0) {}
+
+  bool speaking() const { return m_speaking; }
+
+  /// classify a frame from its interleaved L16 audio (count values, samples per channel)
+  Transition classify(const int16_t* pcm, size_t count, uint32_t samples) {
+    double energy = 0;
+    for (size_t i = 0; i < count; i++) energy += (double) pcm[i] * pcm[i];
+    bool loud = count > 0 && energy / count >= m_threshold;
+
+    if (loud) {
+      m_silentSamples = 0;
+      if (m_speaking) return VAD_NONE;
+      m_speaking = true;
+      return VAD_SPEECH_START;
+    }
+    if (!m_speaking) return VAD_NONE;
+    m_silentSamples += samples;
+    if (m_silentSamples < m_hangoverSamples) return VAD_NONE;
+    m_speaking = false;
+    return VAD_SPEECH_STOP;
+  }
+
+  /// keep a frame that is not being forked, dropping the oldest held beyond the preroll
+  void hold(const uint8_t* data, size_t len, uint32_t samples, int64_t captured) {
+    if (0 == m_prerollSamples) return;
+    while (!m_held.empty() && m_heldSamples + samples > m_prerollSamples) {
+      m_heldSamples -= m_held.front().samples;
+      m_spare.push_back(std::move(m_held.front().data));
+      m_held.pop_front();
+    }
+    if (samples > m_prerollSamples) return;
+
+    // reuse the storage of frames already let go, so holding audio doesn't allocate for every frame
+    held_frame frame;
+    if (!m_spare.empty()) {
+      frame.data.swap(m_spare.back());
+      m_spare.pop_back();
+    }
+    frame.data.assign(data, data + len);
+    frame.samples = samples;
+    frame.captured = captured;
+    m_held.push_back(std::move(frame));
+    m_heldSamples += samples;
+  }
+
+  /// pass the held frames to sink, oldest first, and forget them; returns false if sink dropped any
+  bool release(const Sink& sink) {
+    bool ok = true;
+    while (!m_held.empty()) {
+      held_frame& frame = m_held.front();
+      if (!frame.data.empty() && !sink(&frame.data[0], frame.data.size(), frame.samples, frame.captured)) ok = false;
+      m_spare.push_back(std::move(frame.data));
+      m_held.pop_front();
+    }
+    m_heldSamples = 0;
+    return ok;
+  }
+
+private:
+  EnergyVad(const EnergyVad&);
+  EnergyVad& operator=(const EnergyVad&);
+
+  struct held_frame {
+    std::vector<uint8_t> data;
+    uint32_t samples;
+    int64_t captured;
+  };
+
+  const double m_threshold;           // mean square sample value at the threshold level
+  const uint64_t m_hangoverSamples;
+  const uint64_t m_prerollSamples;
+
+  bool m_speaking;
+  uint64_t m_silentSamples;
+  std::deque<held_frame> m_held;
+  uint64_t m_heldSamples;
+  std::vector<std::vector<uint8_t>> m_spare;
+};
+
+/// G.711 decoding, so the detector can look at audio that is forked without transcoding
+inline int16_t ulaw_to_linear(uint8_t ulaw) {
+  ulaw = ~ulaw;
+  int t = ((ulaw & 0x0f) << 3) + 0x84;
+  t <<= (ulaw & 0x70) >> 4;
+  return (ulaw & 0x80) ? (int16_t) (0x84 - t) : (int16_t) (t - 0x84);
+}
+
+inline int16_t alaw_to_linear(uint8_t alaw) {
+  alaw ^= 0x55;
+  int t = (alaw & 0x0f) << 4;
+  int seg = (alaw & 0x70) >> 4;
+  switch (seg) {
+    case 0: t += 8; break;
+    case 1: t += 0x108; break;
+    default: t += 0x108; t <<= seg - 1; break;
+  }
+  return (alaw & 0x80) ? (int16_t) t : (int16_t) -t;
+}
+
+} // namespace drachtio
+
+#endif // __VAD_HPP__